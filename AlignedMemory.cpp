@@ -21,11 +21,29 @@
 #include <cstddef>
 #include <cassert>
 #include <cstdlib>
+#include <new>
+#include <atomic>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_LIBNUMA
+#include <sched.h>
+#include <numa.h>
+#include <numaif.h>
+#endif
+
+#include "AlignedMemory.h"
 
 using std::ptrdiff_t;
 
 namespace AlignedMemory
 {
+    static std::atomic< size_t > alloc_count( 0 );
+
     void *alloc( size_t size, size_t alignment )
     {
         assert( alignment <= 0x80 );
@@ -35,6 +53,7 @@ namespace AlignedMemory
         ptrdiff_t diff = ((~(reinterpret_cast<ptrdiff_t>(ptr))) & (alignment - 1)) + 1;
         ptr = static_cast<void *>(static_cast<char *>(ptr) + diff);
         (static_cast<char *>(ptr))[-1] = diff;
+        ++alloc_count;
         return ptr;
     }
 
@@ -43,4 +62,97 @@ namespace AlignedMemory
         if( ptr )
             std::free( static_cast<char *>(ptr) - static_cast<ptrdiff_t>(((char *)ptr)[-1]) );
     }
+
+    void *alloc_pages( size_t size, bool hugepages )
+    {
+        const size_t alignment = hugepages ? huge_page_size : page_size;
+        size = (size + alignment - 1) & ~(alignment - 1);
+        if( size == 0 )
+            size = alignment;
+#ifdef _WIN32
+        void *ptr = _aligned_malloc( size, alignment );
+        if( ptr == nullptr )
+            return nullptr;
+#else
+        void *ptr;
+        if( posix_memalign( &ptr, alignment, size ) )
+            return nullptr;
+#ifdef MADV_HUGEPAGE
+        if( hugepages )
+            madvise( ptr, size, MADV_HUGEPAGE );
+#endif
+#endif
+        ++alloc_count;
+        return ptr;
+    }
+
+    void free_pages( void *ptr )
+    {
+#ifdef _WIN32
+        _aligned_free( ptr );
+#else
+        std::free( ptr );
+#endif
+    }
+
+    size_t allocations()
+    {
+        return alloc_count.load( std::memory_order_relaxed );
+    }
+
+    int numa_nodes()
+    {
+#ifdef HAVE_LIBNUMA
+        static const int nodes = numa_available() < 0 ? 1 : numa_max_node() + 1;
+        return nodes;
+#else
+        return 1;
+#endif
+    }
+
+    int numa_node()
+    {
+#ifdef HAVE_LIBNUMA
+        if( numa_nodes() > 1 )
+        {
+            const int cpu  = sched_getcpu();
+            const int node = cpu < 0 ? -1 : numa_node_of_cpu( cpu );
+            if( node > 0 && node < numa_nodes() )
+                return node;
+        }
+#endif
+        return 0;
+    }
+
+    void bind_pages( void *ptr, size_t size, int node )
+    {
+#ifdef HAVE_LIBNUMA
+        /* Preferred rather than strict, so that a full node falls back to another
+         * instead of failing the allocation. */
+        if( numa_nodes() < 2 || node < 0 || node >= static_cast<int>(sizeof(unsigned long) * 8) || size == 0 )
+            return;
+        const unsigned long mask = 1ul << node;
+        size = (size + page_size - 1) & ~(page_size - 1);
+        mbind( ptr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, MPOL_MF_MOVE );
+#else
+        (void)ptr;
+        (void)size;
+        (void)node;
+#endif
+    }
+}
+
+void AlignedArena::commit( bool hugepages )
+{
+    capacity = used;
+    used     = 0;
+    base     = static_cast<char *>(AlignedMemory::alloc_pages( capacity, hugepages ));
+    if( base == nullptr )
+        throw bad_alloc{};
+}
+
+void AlignedArena::bind( size_t from, int node )
+{
+    if( base && used > from )
+        AlignedMemory::bind_pages( base + from, used - from, node );
 }
@@ -20,8 +20,23 @@
 
 namespace AlignedMemory
 {
+    constexpr size_t page_size      = 4096;
+    constexpr size_t huge_page_size = 2 * 1024 * 1024;
     void *alloc( size_t size, size_t alignment );
     void free( void *ptr );
+    /* Page aligned allocation, optionally advised to be backed by transparent huge pages. */
+    void *alloc_pages( size_t size, bool hugepages );
+    void free_pages( void *ptr );
+    /* Number of successful alloc() and alloc_pages() calls since the module was loaded. */
+    size_t allocations();
+    /* NUMA nodes pages can be bound to; 1 when built without libnuma or on a
+     * machine with a single node. */
+    int numa_nodes();
+    /* Node of the CPU the calling thread runs on. */
+    int numa_node();
+    /* Prefer the given node for the pages of a page aligned range, moving those
+     * already touched. Does nothing without libnuma. */
+    void bind_pages( void *ptr, size_t size, int node );
 }
 
 template < typename T, size_t alignment >
@@ -44,3 +59,40 @@ public:
     ~AlignedArrayObject() { AlignedMemory::free( x ); }
     inline T * get() const { return x; }
 };
+
+/* A single contiguous region carved into 64-byte aligned buffers.
+ * Until commit() is called, take() only measures the requested layout and
+ * returns nullptr, so the same placement code can be run once to size the
+ * region and once more to hand out the buffers. The memory is not touched
+ * here; the first write to each page decides where it is placed. */
+class AlignedArena
+{
+private:
+    char  *base;
+    size_t used;
+    size_t capacity;
+public:
+    using bad_alloc = class bad_alloc: std::bad_alloc { using std::bad_alloc::bad_alloc; };
+    static constexpr size_t alignment = 64;
+    AlignedArena() : base( nullptr ), used( 0 ), capacity( 0 ) {}
+    AlignedArena( const AlignedArena & ) = delete;
+    AlignedArena &operator=( const AlignedArena & ) = delete;
+    ~AlignedArena() { AlignedMemory::free_pages( base ); }
+    void commit( bool hugepages );
+    inline void rewind() { used = 0; }
+    inline void align( size_t boundary ) { used = (used + boundary - 1) & ~(boundary - 1); }
+    inline size_t size() const { return base ? capacity : used; }
+    inline size_t offset() const { return used; }
+    /* Binds the pages from the given offset up to the current one to a node. */
+    void bind( size_t from, int node );
+    template < typename T >
+    T *take( size_t n )
+    {
+        align( alignment );
+        T *p = base ? reinterpret_cast< T * >(base + used) : nullptr;
+        used += n * sizeof(T);
+        if( base && used > capacity )
+            throw bad_alloc{};
+        return p;
+    }
+};
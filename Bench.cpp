@@ -0,0 +1,917 @@
+/*****************************************************************************
+ * Bench.cpp
+ *****************************************************************************
+ * Standalone benchmark of the TNLMeans filter.
+ *
+ * The plugin is linked in directly and driven through a minimal in-process
+ * stand-in for the VapourSynth API, so no VapourSynth installation or script
+ * is needed. Synthetic noisy clips are generated for the requested sizes and
+ * bit depths, and every preset is timed on them after one untimed pass. The
+ * timed pass fails if the filter allocates any memory in it.
+ * With --numa, the workers run on the first NUMA node and each preset is
+ * timed with the filter's buffers on that node and on the last one.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef __MINGW32__
+#include "mingw.thread.h"
+#include "mingw.mutex.h"
+#else
+#include <thread>
+#include <mutex>
+#endif
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+#include "VapourSynth.h"
+#include "AlignedMemory.h"
+#include "BenchBaseline.h"
+
+/*----------------------------------------------------------------------------
+ * Heap allocation counter
+ *--------------------------------------------------------------------------*/
+/* Every heap allocation made while a thread runs the getframe of a filter is
+ * counted, except those of the API stand-in, which are the ones VapourSynth
+ * itself would make. Besides operator new, malloc is wrapped where the C
+ * library allows it, so that any heap use of the filter is seen. */
+static std::atomic< size_t > heap_count( 0 );
+static thread_local bool     in_filter = false;
+
+static inline void count_allocation()
+{
+    if( in_filter )
+        heap_count.fetch_add( 1, std::memory_order_relaxed );
+}
+
+/* Marks a call from the filter into the API stand-in. */
+class HostCall
+{
+private:
+    bool saved;
+public:
+    HostCall() : saved( in_filter ) { in_filter = false; }
+    ~HostCall() { in_filter = saved; }
+};
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+/* operator new of libstdc++ goes through malloc. Sanitizers replace malloc
+ * themselves, so their builds count operator new only. */
+extern "C"
+{
+    void *__libc_malloc( size_t size );
+    void *__libc_calloc( size_t count, size_t size );
+    void *__libc_realloc( void *ptr, size_t size );
+    void *malloc( size_t size ) { count_allocation(); return __libc_malloc( size ); }
+    void *calloc( size_t count, size_t size ) { count_allocation(); return __libc_calloc( count, size ); }
+    void *realloc( void *ptr, size_t size ) { count_allocation(); return __libc_realloc( ptr, size ); }
+}
+#else
+/* The other forms of new and delete call these two. */
+void *operator new( size_t size )
+{
+    count_allocation();
+    void *ptr = std::malloc( size ? size : 1 );
+    if( ptr == nullptr )
+        throw std::bad_alloc();
+    return ptr;
+}
+void operator delete( void *ptr ) noexcept { std::free( ptr ); }
+#endif
+
+/* Allocations of the filter so far, from the heap or as aligned buffers. */
+static size_t allocations()
+{
+    return heap_count.load( std::memory_order_relaxed ) + AlignedMemory::allocations();
+}
+
+/*----------------------------------------------------------------------------
+ * Minimal VapourSynth API stand-in
+ *--------------------------------------------------------------------------*/
+struct BenchValue
+{
+    char               type;
+    int64_t            i;
+    double             f;
+    std::string        s;
+    VSNodeRef         *node;
+};
+
+struct VSMap
+{
+    std::map< std::string, std::vector< BenchValue > > values;
+    std::string error;
+};
+
+struct VSFrameRef
+{
+    std::atomic< int >     refs;
+    const VSFormat        *format;
+    int                    width;
+    int                    height;
+    int                    stride[3];
+    std::vector< uint8_t > data[3];
+    VSMap                  props;
+};
+
+struct VSNodeRef
+{
+    VSVideoInfo                 vi;
+    std::vector< VSFrameRef * > frames;     /* source clip */
+    VSFilterGetFrame            getframe;   /* filter */
+    VSFilterFree                free;
+    void                       *instance;
+    int                         mode;
+    std::mutex                  mtx;
+};
+
+struct VSFrameContext
+{
+    std::string error;
+};
+
+struct VSCore
+{
+    VSCoreInfo info;
+};
+
+static VSAPI    api;
+static VSCore   bench_core;
+static VSFormat formats[16];
+
+static VSFrameRef *alloc_frame( const VSFormat *format, int width, int height )
+{
+    VSFrameRef *f = new VSFrameRef;
+    f->refs   = 1;
+    f->format = format;
+    f->width  = width;
+    f->height = height;
+    for( int i = 0; i < format->numPlanes; ++i )
+    {
+        const int w = width  >> (i ? format->subSamplingW : 0);
+        const int h = height >> (i ? format->subSamplingH : 0);
+        f->stride[i] = (w * format->bytesPerSample + 63) & ~63;
+        f->data  [i].assign( static_cast<size_t>(f->stride[i]) * h, 0 );
+    }
+    return f;
+}
+
+static const VSFrameRef *get_frame( VSNodeRef *node, int n );
+
+static const VSCoreInfo *VS_CC getCoreInfo( VSCore *core ) { return &core->info; }
+static const VSFrameRef *VS_CC cloneFrameRef( const VSFrameRef *f ) { ++const_cast<VSFrameRef *>(f)->refs; return f; }
+static VSNodeRef *VS_CC cloneNodeRef( VSNodeRef *node ) { return node; }
+static void VS_CC freeNode( VSNodeRef * ) {}
+static void VS_CC freeFrame( const VSFrameRef *f )
+{
+    if( f && --const_cast<VSFrameRef *>(f)->refs == 0 )
+        delete f;
+}
+static VSFrameRef *VS_CC newVideoFrame( const VSFormat *format, int width, int height, const VSFrameRef *propSrc, VSCore * )
+{
+    HostCall host;
+    VSFrameRef *f = alloc_frame( format, width, height );
+    if( propSrc )
+        f->props.values = propSrc->props.values;
+    return f;
+}
+static void VS_CC setError( VSMap *map, const char *msg ) { map->error = msg; }
+static const char *VS_CC getError( const VSMap *map ) { return map->error.empty() ? nullptr : map->error.c_str(); }
+static void VS_CC setFilterError( const char *msg, VSFrameContext *ctx ) { HostCall host; ctx->error = msg; }
+static const VSFormat *VS_CC registerFormat( int colorFamily, int sampleType, int bitsPerSample, int subSamplingW, int subSamplingH, VSCore * )
+{
+    static std::mutex mtx;
+    std::lock_guard< std::mutex > lock( mtx );
+    for( auto &f : formats )
+    {
+        if( f.id && f.colorFamily == colorFamily && f.bitsPerSample == bitsPerSample
+         && f.subSamplingW == subSamplingW && f.subSamplingH == subSamplingH )
+            return &f;
+        if( f.id == 0 )
+        {
+            f.id             = static_cast<int>(&f - formats) + 1;
+            f.colorFamily    = colorFamily;
+            f.sampleType     = sampleType;
+            f.bitsPerSample  = bitsPerSample;
+            f.bytesPerSample = bitsPerSample > 8 ? 2 : 1;
+            f.subSamplingW   = subSamplingW;
+            f.subSamplingH   = subSamplingH;
+            f.numPlanes      = colorFamily == cmGray ? 1 : 3;
+            snprintf( f.name, sizeof(f.name), "%s%d", colorFamily == cmGray ? "Gray" : "YUV", bitsPerSample );
+            return &f;
+        }
+    }
+    return nullptr;
+}
+static const VSFrameRef *VS_CC getFrameFilter( int n, VSNodeRef *node, VSFrameContext * ) { HostCall host; return get_frame( node, n ); }
+static void VS_CC requestFrameFilter( int, VSNodeRef *, VSFrameContext * ) {}
+static void VS_CC getFrameAsync( int n, VSNodeRef *node, VSFrameDoneCallback callback, void *user_data )
+{
+    const VSFrameRef *f;
+    {
+        HostCall host;
+        f = get_frame( node, n );
+    }
+    callback( user_data, f, n, node, nullptr );
+}
+static int VS_CC getStride( const VSFrameRef *f, int plane ) { return f->stride[plane]; }
+static const uint8_t *VS_CC getReadPtr( const VSFrameRef *f, int plane ) { return f->data[plane].data(); }
+static uint8_t *VS_CC getWritePtr( VSFrameRef *f, int plane ) { return f->data[plane].data(); }
+static const VSVideoInfo *VS_CC getVideoInfo( VSNodeRef *node ) { return &node->vi; }
+static void VS_CC setVideoInfo( const VSVideoInfo *vi, int, VSNode *node ) { reinterpret_cast<VSNodeRef *>(node)->vi = *vi; }
+static const VSFormat *VS_CC getFrameFormat( const VSFrameRef *f ) { return f->format; }
+static int VS_CC getFrameWidth ( const VSFrameRef *f, int plane ) { return f->width  >> (plane ? f->format->subSamplingW : 0); }
+static int VS_CC getFrameHeight( const VSFrameRef *f, int plane ) { return f->height >> (plane ? f->format->subSamplingH : 0); }
+static const VSMap *VS_CC getFramePropsRO( const VSFrameRef *f ) { return &f->props; }
+static VSMap *VS_CC getFramePropsRW( VSFrameRef *f ) { return &f->props; }
+static int VS_CC propDeleteKey( VSMap *map, const char *key ) { HostCall host; return static_cast<int>(map->values.erase( key )); }
+
+static const BenchValue *prop_get( const VSMap *map, const char *key, int index, int *error, char type )
+{
+    HostCall host;
+    int e = 0;
+    const BenchValue *v = nullptr;
+    auto it = map->values.find( key );
+    if( it == map->values.end() )                         e = peUnset;
+    else if( index >= static_cast<int>(it->second.size()) ) e = peIndex;
+    else if( it->second[index].type != type )              e = peType;
+    else                                                   v = &it->second[index];
+    if( error )
+        *error = e;
+    else if( e )
+    {
+        fprintf( stderr, "tnlmeans_bench: missing property %s\n", key );
+        abort();
+    }
+    return v;
+}
+static int prop_set( VSMap *map, const char *key, const BenchValue &v, int append )
+{
+    HostCall host;
+    std::vector< BenchValue > &values = map->values[key];
+    if( append == paReplace )
+        values.clear();
+    values.push_back( v );
+    return 0;
+}
+static int64_t VS_CC propGetInt( const VSMap *map, const char *key, int index, int *error )
+{
+    const BenchValue *v = prop_get( map, key, index, error, 'i' );
+    return v ? v->i : 0;
+}
+static double VS_CC propGetFloat( const VSMap *map, const char *key, int index, int *error )
+{
+    const BenchValue *v = prop_get( map, key, index, error, 'f' );
+    return v ? v->f : 0.0;
+}
+static VSNodeRef *VS_CC propGetNode( const VSMap *map, const char *key, int index, int *error )
+{
+    const BenchValue *v = prop_get( map, key, index, error, 'c' );
+    return v ? v->node : nullptr;
+}
+static int VS_CC propSetInt( VSMap *map, const char *key, int64_t i, int append )
+{
+    BenchValue v{ 'i', i, 0.0, std::string(), nullptr };
+    return prop_set( map, key, v, append );
+}
+static int VS_CC propSetFloat( VSMap *map, const char *key, double f, int append )
+{
+    BenchValue v{ 'f', 0, f, std::string(), nullptr };
+    return prop_set( map, key, v, append );
+}
+static int VS_CC propSetData( VSMap *map, const char *key, const char *data, int size, int append )
+{
+    BenchValue v{ 's', 0, 0.0, size < 0 ? std::string( data ) : std::string( data, size ), nullptr };
+    return prop_set( map, key, v, append );
+}
+static int VS_CC propSetNode( VSMap *map, const char *key, VSNodeRef *node, int append )
+{
+    BenchValue v{ 'c', 0, 0.0, std::string(), node };
+    return prop_set( map, key, v, append );
+}
+
+static void VS_CC createFilter
+(
+    const VSMap     *in,
+    VSMap           *out,
+    const char      *,
+    VSFilterInit     init,
+    VSFilterGetFrame getFrame,
+    VSFilterFree     free,
+    int              filterMode,
+    int,
+    void            *instanceData,
+    VSCore          *core
+)
+{
+    VSNodeRef *node = new VSNodeRef;
+    node->getframe = getFrame;
+    node->free     = free;
+    node->instance = instanceData;
+    node->mode     = filterMode;
+    init( const_cast<VSMap *>(in), out, &node->instance, reinterpret_cast<VSNode *>(node), core, &api );
+    propSetNode( out, "clip", node, paReplace );
+}
+
+static const VSFrameRef *get_frame( VSNodeRef *node, int n )
+{
+    n = std::min( std::max( n, 0 ), node->vi.numFrames - 1 );
+    if( node->getframe == nullptr )
+        return cloneFrameRef( node->frames[n] );
+    std::unique_lock< std::mutex > lock( node->mtx, std::defer_lock );
+    if( node->mode != fmParallel )
+        lock.lock();
+    VSFrameContext ctx;
+    void *frame_data = nullptr;
+    in_filter = true;
+    node->getframe( n, arInitial, &node->instance, &frame_data, &ctx, &bench_core, &api );
+    const VSFrameRef *f = node->getframe( n, arAllFramesReady, &node->instance, &frame_data, &ctx, &bench_core, &api );
+    in_filter = false;
+    if( !ctx.error.empty() )
+        fprintf( stderr, "tnlmeans_bench: frame %d: %s\n", n, ctx.error.c_str() );
+    return f;
+}
+
+static void init_api()
+{
+    api.getCoreInfo        = getCoreInfo;
+    api.cloneFrameRef      = cloneFrameRef;
+    api.cloneNodeRef       = cloneNodeRef;
+    api.freeFrame          = freeFrame;
+    api.freeNode           = freeNode;
+    api.newVideoFrame      = newVideoFrame;
+    api.createFilter       = createFilter;
+    api.setError           = setError;
+    api.getError           = getError;
+    api.setFilterError     = setFilterError;
+    api.registerFormat     = registerFormat;
+    api.getFrameFilter     = getFrameFilter;
+    api.requestFrameFilter = requestFrameFilter;
+    api.getFrameAsync      = getFrameAsync;
+    api.getStride          = getStride;
+    api.getReadPtr         = getReadPtr;
+    api.getWritePtr        = getWritePtr;
+    api.getVideoInfo       = getVideoInfo;
+    api.setVideoInfo       = setVideoInfo;
+    api.getFrameFormat     = getFrameFormat;
+    api.getFrameWidth      = getFrameWidth;
+    api.getFrameHeight     = getFrameHeight;
+    api.getFramePropsRO    = getFramePropsRO;
+    api.getFramePropsRW    = getFramePropsRW;
+    api.propDeleteKey      = propDeleteKey;
+    api.propGetInt         = propGetInt;
+    api.propGetFloat       = propGetFloat;
+    api.propGetNode        = propGetNode;
+    api.propSetInt         = propSetInt;
+    api.propSetFloat       = propSetFloat;
+    api.propSetData        = propSetData;
+    api.propSetNode        = propSetNode;
+}
+
+/*----------------------------------------------------------------------------
+ * Plugin entry
+ *--------------------------------------------------------------------------*/
+extern "C" void VS_CC VapourSynthPluginInit( VSConfigPlugin, VSRegisterFunction, VSPlugin * );
+
+static VSPublicFunction create_tnlmeans;
+
+static void VS_CC config_plugin( const char *, const char *, const char *, int, int, VSPlugin * ) {}
+static void VS_CC register_function( const char *name, const char *, VSPublicFunction func, void *, VSPlugin * )
+{
+    if( strcmp( name, "TNLMeans" ) == 0 )
+        create_tnlmeans = func;
+}
+
+/*----------------------------------------------------------------------------
+ * Synthetic clips
+ *--------------------------------------------------------------------------*/
+static VSNodeRef *make_clip( const VSFormat *format, int width, int height, int frames, uint32_t seed )
+{
+    /* Smooth gradients and edges moving by two pixels per frame, flat patches,
+     * stripes spanning the whole range, and uniform noise of about 6% of it. */
+    VSNodeRef *node = new VSNodeRef;
+    node->vi       = VSVideoInfo{ format, 24, 1, width, height, frames, 0 };
+    node->getframe = nullptr;
+    const int peak = (1 << format->bitsPerSample) - 1;
+    for( int n = 0; n < frames; ++n )
+    {
+        VSFrameRef *f = alloc_frame( format, width, height );
+        for( int i = 0; i < format->numPlanes; ++i )
+        {
+            const int w = getFrameWidth ( f, i );
+            const int h = getFrameHeight( f, i );
+            for( int y = 0; y < h; ++y )
+                for( int x = 0; x < w; ++x )
+                {
+                    double value = 0.5 + 0.3 * std::sin( (x + n * 2) * 0.15 ) * std::cos( y * 0.1 + i );
+                    if( (x / 16 + y / 16) % 5 == 0 )
+                        value = 0.5;
+                    else if( (x / 16 + y / 16) % 7 == 3 )
+                        value = (x / 3) % 2;
+                    seed = seed * 1664525u + 1013904223u;
+                    value += (static_cast<int>((seed >> 8) % 41) - 20) / 255.0;
+                    const int v = std::min( std::max( static_cast<int>(value * peak + 0.5), 0 ), peak );
+                    if( format->bytesPerSample == 1 )
+                        f->data[i][y * f->stride[i] + x] = static_cast<uint8_t>(v);
+                    else
+                        reinterpret_cast<uint16_t *>(&f->data[i][y * f->stride[i]])[x] = static_cast<uint16_t>(v);
+                }
+        }
+        node->frames.push_back( f );
+    }
+    return node;
+}
+
+static VSNodeRef *make_filter( VSNodeRef *clip, const std::vector< std::string > &args )
+{
+    VSMap in, out;
+    propSetNode( &in, "clip", clip, paReplace );
+    for( const std::string &arg : args )
+    {
+        const size_t eq = arg.find( '=' );
+        if( eq == std::string::npos )
+            continue;
+        const std::string key   = arg.substr( 0, eq );
+        const std::string value = arg.substr( eq + 1 );
+        if( value.find( '.' ) != std::string::npos )
+            propSetFloat( &in, key.c_str(), atof( value.c_str() ), paReplace );
+        else
+            propSetInt( &in, key.c_str(), atoll( value.c_str() ), paReplace );
+    }
+    create_tnlmeans( &in, &out, nullptr, &bench_core, &api );
+    if( getError( &out ) )
+    {
+        fprintf( stderr, "tnlmeans_bench: %s\n", getError( &out ) );
+        return nullptr;
+    }
+    return propGetNode( &out, "clip", 0, nullptr );
+}
+
+static void free_filter( VSNodeRef *node )
+{
+    node->free( node->instance, &bench_core, &api );
+    delete node;
+}
+
+/*----------------------------------------------------------------------------
+ * Benchmark
+ *--------------------------------------------------------------------------*/
+struct Preset
+{
+    const char *name;
+    const char *engine;
+    const char *args;
+};
+
+static const Preset presets[] =
+{
+    { "pixel",          "WOZ",  "ax=2 ay=2 az=0 sx=2 sy=2 bx=0 by=0" },
+    { "block",          "WOZB", "ax=4 ay=4 az=0 sx=2 sy=2 bx=1 by=1" },
+    { "temporal",       "WZ",   "ax=2 ay=2 az=1 sx=2 sy=2 bx=0 by=0" },
+    { "temporal-block", "WZB",  "ax=4 ay=4 az=1 sx=2 sy=2 bx=1 by=1" },
+};
+
+static std::vector< std::string > split( const char *s )
+{
+    std::vector< std::string > list;
+    std::string item;
+    for( ; ; ++s )
+    {
+        if( *s == ' ' || *s == ',' || *s == '\0' )
+        {
+            if( !item.empty() )
+                list.push_back( item );
+            item.clear();
+            if( *s == '\0' )
+                break;
+        }
+        else
+            item += *s;
+    }
+    return list;
+}
+
+static const char *depth_args( int bits )
+{
+    /* Scale the default strength to the bit depth. */
+    static const char *h[] = { "h=8.0", "h=16.0", "h=32.0", "h=64.0", "h=128.0", "h=256.0", "h=512.0", "h=1024.0", "h=2048.0" };
+    return h[bits - 8];
+}
+
+/* 'node' is the NUMA node the workers prefer for the memory they touch first,
+ * or -1 to leave it to the system. */
+static void render( VSNodeRef *filter, int frames, int threads, std::vector< const VSFrameRef * > *output, int node = -1 )
+{
+    if( output )
+        output->assign( frames, nullptr );
+    std::atomic< int > next( 0 );
+    std::vector< std::thread > workers;
+    for( int t = 0; t < threads; ++t )
+        workers.emplace_back( [&]()
+        {
+#ifdef HAVE_LIBNUMA
+            if( node >= 0 )
+                numa_set_preferred( node );
+#else
+            (void)node;
+#endif
+            for( int n; (n = next++) < frames; )
+            {
+                const VSFrameRef *f = get_frame( filter, n );
+                if( output )
+                    (*output)[n] = f;
+                else
+                    freeFrame( f );
+            }
+        } );
+    for( std::thread &worker : workers )
+        worker.join();
+}
+
+/*----------------------------------------------------------------------------
+ * Verification
+ *--------------------------------------------------------------------------*/
+/* Every engine is run with both distances, all supported sample sizes and a
+ * small matrix of window sizes on a fixed synthetic clip. The raw output of
+ * each run is written to, or compared against, one file per configuration in
+ * a directory, so the output of a modified build can be checked against the
+ * one of a known-good build with only a compiler at hand. Without a directory,
+ * each run is compared with the generic code (simd=0) on a single thread,
+ * which needs nothing but the binary itself. The generic code can also be
+ * checked against the checksums of the original implementation in
+ * BenchBaseline.h. Every run also fails if the filter still allocates memory
+ * when the same frames are filtered again. */
+enum { VERIFY_WRITE, VERIFY_FILES, VERIFY_GENERIC, VERIFY_BASELINE };
+
+/* With 'steady', the frames are filtered once more after the output is taken,
+ * and the allocations the filter made during that pass are counted into it.
+ * Once every working set is in use, there should be none. */
+static std::vector< uint8_t > render_raw( VSNodeRef *clip, const std::vector< std::string > &args, int frames, int threads, size_t *steady = nullptr )
+{
+    std::vector< uint8_t > data;
+    VSNodeRef *filter = make_filter( clip, args );
+    if( filter == nullptr )
+        return data;
+    std::vector< const VSFrameRef * > output;
+    render( filter, frames, threads, &output );
+    if( steady )
+    {
+        const size_t before = allocations();
+        render( filter, frames, threads, nullptr );
+        *steady = allocations() - before;
+    }
+    for( const VSFrameRef *f : output )
+        for( int i = 0; i < f->format->numPlanes; ++i )
+        {
+            const int row = getFrameWidth( f, i ) * f->format->bytesPerSample;
+            for( int y = 0; y < getFrameHeight( f, i ); ++y )
+                data.insert( data.end(), &f->data[i][y * f->stride[i]], &f->data[i][y * f->stride[i]] + row );
+        }
+    for( const VSFrameRef *f : output )
+        freeFrame( f );
+    free_filter( filter );
+    return data;
+}
+
+static bool compare_raw( const std::string &name, const std::vector< uint8_t > &data, const std::vector< uint8_t > &reference, int bytes, int tolerance )
+{
+    int    max_diff = 0;
+    size_t over     = 0;
+    const size_t samples = data.size() / bytes;
+    for( size_t k = 0; k < samples; ++k )
+    {
+        const int a = bytes == 1 ? data[k]      : reinterpret_cast<const uint16_t *>(data.data())[k];
+        const int b = bytes == 1 ? reference[k] : reinterpret_cast<const uint16_t *>(reference.data())[k];
+        const int d = std::abs( a - b );
+        max_diff = std::max( max_diff, d );
+        over += d > tolerance;
+    }
+    printf( "%-40s %s  max diff %d, %zu of %zu samples over tolerance\n",
+            name.c_str(), over ? "FAIL" : "ok  ", max_diff, over, samples );
+    return over == 0;
+}
+
+/* The output must hash to that of the original implementation once the samples
+ * listed as drift are set back to their original value, each of which may only
+ * differ by 1. */
+static bool compare_baseline( const std::string &name, const std::vector< uint8_t > &data, int bytes )
+{
+    const BenchBaseline *entry = nullptr;
+    for( const BenchBaseline &b : bench_baseline )
+        if( name == b.name )
+            entry = &b;
+    if( entry == nullptr )
+    {
+        printf( "%-40s FAIL  no baseline\n", name.c_str() );
+        return false;
+    }
+    const size_t samples = data.size() / bytes;
+    std::vector< int > values( samples );
+    for( size_t k = 0; k < samples; ++k )
+        values[k] = bytes == 1 ? data[k] : reinterpret_cast<const uint16_t *>(data.data())[k];
+    int drift = 0;
+    for( const char *p = entry->drift; p && *p; )
+    {
+        char *end;
+        const size_t k = strtoul( p, &end, 10 );
+        const int    v = static_cast<int>(strtol( end + 1, &end, 10 ));
+        p = end;
+        if( k >= samples || std::abs( values[k] - v ) > 1 )
+        {
+            printf( "%-40s FAIL  sample %zu is not within 1 of its original value %d\n", name.c_str(), k, v );
+            return false;
+        }
+        values[k] = v;
+        ++drift;
+    }
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for( const int v : values )
+        for( int i = 0; i < bytes; ++i )
+            hash = (hash ^ ((v >> (i * 8)) & 0xff)) * 0x100000001b3ull;
+    const bool same = hash == entry->hash;
+    if( entry->overflow )
+        printf( "%-40s %s  16-bit squares no longer overflow\n", name.c_str(), same ? "ok  " : "FAIL" );
+    else
+        printf( "%-40s %s  drift in %d samples\n", name.c_str(), same ? "ok  " : "FAIL", drift );
+    return same;
+}
+
+static int verify( const std::string &dir, int mode, int tolerance, int threads, const std::vector< std::string > &extra )
+{
+    static const int   depths [] = { 8, 10, 16 };
+    static const char *windows[] = { "ax=1 ay=1 sx=1 sy=1", "ax=3 ay=2 sx=1 sy=2", "ax=2 ay=3 sx=3 sy=1" };
+    static const char *blocks [] = { "bx=1 by=1", "bx=0 by=1" };
+    const int width  = 96;
+    const int height = 64;
+    const int frames = 4;
+    int failures = 0;
+    int runs     = 0;
+    for( int bits : depths )
+    {
+        const VSFormat *format = registerFormat( cmYUV, stInteger, bits, 1, 1, &bench_core );
+        VSNodeRef *clip = make_clip( format, width, height, frames, 54321 );
+        for( const Preset &preset : presets )
+            for( int ssd = 0; ssd < 2; ++ssd )
+                for( const char *window : windows )
+                    for( const char *block : blocks )
+                    {
+                        const bool block_engine = strstr( preset.args, "bx=0" ) == nullptr;
+                        if( !block_engine && block != blocks[0] )
+                            continue;
+                        std::vector< std::string > args = split( preset.args );
+                        const std::vector< std::string > more = split( ( std::string( window ) + (block_engine ? std::string( " " ) + block : "") ).c_str() );
+                        args.insert( args.end(), more.begin(), more.end() );
+                        args.push_back( "ssd=" + std::to_string( ssd ) );
+                        args.insert( args.begin(), depth_args( bits ) );
+                        std::string name = std::string( preset.engine ) + "-ssd" + std::to_string( ssd ) + "-" + std::to_string( bits ) + "bit";
+                        for( const std::string &arg : more )
+                            name += "-" + arg.substr( 0, arg.find( '=' ) ) + arg.substr( arg.find( '=' ) + 1 );
+                        std::vector< std::string > tested = args;
+                        if( mode == VERIFY_BASELINE )
+                            tested.push_back( "simd=0" );
+                        tested.insert( tested.end(), extra.begin(), extra.end() );
+                        size_t steady = 0;
+                        const std::vector< uint8_t > data = render_raw( clip, tested, frames, threads, &steady );
+                        if( data.empty() )
+                            return 1;
+                        ++runs;
+                        if( steady )
+                        {
+                            printf( "%-40s FAIL  %zu allocations after the first pass\n", name.c_str(), steady );
+                            ++failures;
+                            continue;
+                        }
+
+                        if( mode == VERIFY_BASELINE )
+                        {
+                            failures += !compare_baseline( name, data, format->bytesPerSample );
+                            continue;
+                        }
+                        std::vector< uint8_t > reference( data.size() );
+                        if( mode == VERIFY_GENERIC )
+                        {
+                            args.push_back( "simd=0" );
+                            reference = render_raw( clip, args, frames, 1 );
+                            if( reference.empty() )
+                                return 1;
+                        }
+                        else
+                        {
+                            const std::string path = dir + "/" + name + ".raw";
+                            FILE *fp = fopen( path.c_str(), mode == VERIFY_WRITE ? "wb" : "rb" );
+                            if( mode == VERIFY_WRITE )
+                            {
+                                if( fp == nullptr || fwrite( data.data(), 1, data.size(), fp ) != data.size() )
+                                {
+                                    fprintf( stderr, "tnlmeans_bench: cannot write %s\n", path.c_str() );
+                                    return 1;
+                                }
+                                fclose( fp );
+                                continue;
+                            }
+                            const bool complete = fp && fread( reference.data(), 1, reference.size(), fp ) == reference.size() && fgetc( fp ) == EOF;
+                            if( fp )
+                                fclose( fp );
+                            if( !complete )
+                            {
+                                printf( "%-40s missing or truncated reference\n", name.c_str() );
+                                ++failures;
+                                continue;
+                            }
+                        }
+                        failures += !compare_raw( name, data, reference, format->bytesPerSample, tolerance );
+                    }
+        for( VSFrameRef *f : clip->frames )
+            freeFrame( f );
+        delete clip;
+    }
+    if( mode == VERIFY_WRITE )
+        printf( "%d references written to %s\n", runs, dir.c_str() );
+    else if( mode == VERIFY_BASELINE )
+        printf( "%d of %d configurations differ from the baseline\n", failures, runs );
+    else
+        printf( "%d of %d configurations differ by more than %d\n", failures, runs, tolerance );
+    return failures ? 1 : 0;
+}
+
+static void usage()
+{
+    fprintf( stderr,
+        "Usage: tnlmeans_bench [options] [key=value ...]\n"
+        "options:\n"
+        "  -s WxH[,WxH...]     frame sizes                     [640x360,1280x720]\n"
+        "  -b BITS[,BITS...]   bit depths (YUV 4:2:0)          [8,10]\n"
+        "  -p NAME[,NAME...]   presets: pixel, block, temporal, temporal-block [all]\n"
+        "  -f FRAMES           frames per run                  [8]\n"
+        "  -t THREADS          threads                         [1]\n"
+        "  --reference DIR     write the output of the verification matrix to DIR\n"
+        "  --verify DIR        compare the output of the verification matrix with DIR\n"
+        "  --check             compare the output of the verification matrix with simd=0\n"
+        "  --baseline          compare the output of simd=0 with the original implementation\n"
+        "  --tolerance N       largest difference accepted by --verify and --check [0]\n"
+        "  --numa              compare buffers on the workers' NUMA node with a remote one\n"
+        "key=value pairs are passed to TNLMeans after the preset's own arguments.\n" );
+}
+
+int main( int argc, char **argv )
+{
+    std::vector< std::string > sizes   = split( "640x360,1280x720" );
+    std::vector< std::string > depths  = split( "8,10" );
+    std::vector< std::string > names;
+    std::vector< std::string > extra;
+    std::string reference;
+    std::string check;
+    int frames    = 8;
+    int threads   = 1;
+    int tolerance = 0;
+    bool numa     = false;
+    bool generic  = false;
+    bool baseline = false;
+    for( int i = 1; i < argc; ++i )
+    {
+        const std::string arg = argv[i];
+        if( arg == "-h" || arg == "--help" ) { usage(); return 0; }
+        else if( arg == "-s" && i + 1 < argc ) sizes  = split( argv[++i] );
+        else if( arg == "-b" && i + 1 < argc ) depths = split( argv[++i] );
+        else if( arg == "-p" && i + 1 < argc ) names  = split( argv[++i] );
+        else if( arg == "-f" && i + 1 < argc ) frames  = std::max( atoi( argv[++i] ), 1 );
+        else if( arg == "-t" && i + 1 < argc ) threads = std::max( atoi( argv[++i] ), 1 );
+        else if( arg == "--reference" && i + 1 < argc ) reference = argv[++i];
+        else if( arg == "--verify"    && i + 1 < argc ) check     = argv[++i];
+        else if( arg == "--check" ) generic = true;
+        else if( arg == "--baseline" ) baseline = true;
+        else if( arg == "--tolerance" && i + 1 < argc ) tolerance = std::max( atoi( argv[++i] ), 0 );
+        else if( arg == "--numa" ) numa = true;
+        else if( arg.find( '=' ) != std::string::npos ) extra.push_back( arg );
+        else { usage(); return 1; }
+    }
+
+    init_api();
+    bench_core.info = VSCoreInfo{ "tnlmeans_bench", 54, VAPOURSYNTH_API_VERSION, threads, int64_t(1) << 30, 0 };
+    VapourSynthPluginInit( config_plugin, register_function, nullptr );
+    if( !reference.empty() )
+        return verify( reference, VERIFY_WRITE, tolerance, threads, extra );
+    if( !check.empty() )
+        return verify( check, VERIFY_FILES, tolerance, threads, extra );
+    if( generic )
+        return verify( std::string(), VERIFY_GENERIC, tolerance, threads, extra );
+    if( baseline )
+        return verify( std::string(), VERIFY_BASELINE, tolerance, threads, extra );
+
+    /* The local runs let the filter bind its buffers to the workers' node, the
+     * remote ones turn that off and have the workers touch them first while
+     * preferring the last node. The source frames stay on the first node. */
+    int  remote = -1;
+    bool failed = false;
+    if( numa )
+    {
+#ifdef HAVE_LIBNUMA
+        if( numa_available() < 0 || numa_max_node() < 1 )
+        {
+            fprintf( stderr, "tnlmeans_bench: --numa needs more than one NUMA node\n" );
+            return 1;
+        }
+        numa_run_on_node( 0 );
+        numa_set_preferred( 0 );
+        remote = numa_max_node();
+#else
+        fprintf( stderr, "tnlmeans_bench: --numa needs a build with libnuma\n" );
+        return 1;
+#endif
+    }
+
+    if( numa )
+        printf( "%-16s %-6s %-10s %-4s %10s %10s %8s\n", "preset", "engine", "size", "bits", "local f/s", "remote f/s", "rem/loc" );
+    else
+        printf( "%-16s %-6s %-10s %-4s %10s %12s\n", "preset", "engine", "size", "bits", "frames/s", "ns/pixel" );
+    for( const std::string &size : sizes )
+    {
+        int width, height;
+        if( sscanf( size.c_str(), "%dx%d", &width, &height ) != 2 || width <= 0 || height <= 0 )
+        {
+            fprintf( stderr, "tnlmeans_bench: invalid size %s\n", size.c_str() );
+            return 1;
+        }
+        for( const std::string &depth : depths )
+        {
+            const int bits = atoi( depth.c_str() );
+            const VSFormat *format = registerFormat( cmYUV, stInteger, bits, 1, 1, &bench_core );
+            if( bits < 8 || bits > 16 || format == nullptr )
+            {
+                fprintf( stderr, "tnlmeans_bench: invalid bit depth %s\n", depth.c_str() );
+                return 1;
+            }
+            VSNodeRef *clip = make_clip( format, width, height, frames, 12345 );
+            for( const Preset &preset : presets )
+            {
+                if( !names.empty() && std::find( names.begin(), names.end(), preset.name ) == names.end() )
+                    continue;
+                std::vector< std::string > args = split( preset.args );
+                args.insert( args.end(), extra.begin(), extra.end() );
+                args.insert( args.begin(), depth_args( bits ) );
+                double seconds[2] = {};
+                for( int run = 0; run < (numa ? 2 : 1); ++run )
+                {
+                    if( numa )
+                        args.push_back( run ? "numa=0" : "numa=1" );
+                    VSNodeRef *filter = make_filter( clip, args );
+                    if( filter == nullptr )
+                        return 1;
+                    /* Filter the frames once untimed, so that the timed pass finds
+                     * every buffer in place and must not allocate any more. */
+                    render( filter, frames, threads, nullptr, run ? remote : -1 );
+                    const size_t before = allocations();
+                    const auto   start  = std::chrono::steady_clock::now();
+                    render( filter, frames, threads, nullptr, run ? remote : -1 );
+                    seconds[run] = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+                    if( const size_t count = allocations() - before )
+                    {
+                        fprintf( stderr, "tnlmeans_bench: %s allocated %zu times while timed\n", preset.name, count );
+                        failed = true;
+                    }
+                    free_filter( filter );
+                    if( numa )
+                        args.pop_back();
+                }
+                if( numa )
+                    printf( "%-16s %-6s %-10s %-4d %10.2f %10.2f %8.3f\n",
+                            preset.name, preset.engine, size.c_str(), bits,
+                            frames / seconds[0], frames / seconds[1], seconds[0] / seconds[1] );
+                else
+                    printf( "%-16s %-6s %-10s %-4d %10.2f %12.1f\n",
+                            preset.name, preset.engine, size.c_str(), bits,
+                            frames / seconds[0], seconds[0] * 1e9 / (double(frames) * width * height) );
+                fflush( stdout );
+            }
+            for( VSFrameRef *f : clip->frames )
+                freeFrame( f );
+            delete clip;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+/*****************************************************************************
+ * BenchBaseline.h
+ *****************************************************************************
+ * Checksums of the verification matrix of the benchmark as filtered by the
+ * original implementation of TNLMeans, for 'tnlmeans_bench --baseline'.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* 'hash' is the FNV-1a hash of the raw output of one configuration, 16-bit
+ * samples taken low byte first, as written by '--reference' from a build of
+ * the original scalar code.
+ *
+ * 'drift' lists the samples, as "index:value", that the generic code (simd=0)
+ * now rounds the other way. WOZ and WZ with ssd=1 weigh each pair of patches
+ * from column sums of the squared differences (CompareOffsets), which adds the
+ * same terms in another order than the original per-pair loop; the distance
+ * then differs in its last bits, and a weight near a rounding boundary moves
+ * the sample by 1. 'value' is the sample of the original output.
+ *
+ * 'overflow' marks the 16-bit configurations with ssd=1. The original code
+ * squared their differences in int, which overflows for differences above
+ * 46340; its output differs wherever such a difference enters a patch, and
+ * 'hash' is that of the output once the squares are taken in double. */
+struct BenchBaseline
+{
+    const char *name;
+    uint64_t    hash;
+    const char *drift;
+    bool        overflow;
+};
+
+static const BenchBaseline bench_baseline[] =
+{
+    { "WOZ-ssd0-8bit-ax1-ay1-sx1-sy1",           0x1e794fdfda1b84f4ull, nullptr, false },
+    { "WOZ-ssd0-8bit-ax3-ay2-sx1-sy2",           0xc8bb628ee3cca36eull, nullptr, false },
+    { "WOZ-ssd0-8bit-ax2-ay3-sx3-sy1",           0xd9959da0a219009cull, nullptr, false },
+    { "WOZ-ssd1-8bit-ax1-ay1-sx1-sy1",           0xc6d796dbe91b6d16ull,
+      "1401:248 1403:249 1407:243 1670:3 3194:8 3200:216 4444:242 4707:238 4708:244 "
+      "6080:130 6991:190 7003:14 7669:5 8494:247 8495:247 9199:120 9208:250 12416:200 "
+      "13660:246 13925:249 15274:245 17743:184 19827:247 19836:10 19837:10 21553:144 "
+      "21626:2 21632:186 22864:240 22865:252 23145:249 23147:243 24496:122 26102:15 "
+      "26104:243 26959:185 26973:251 27638:6 29327:249 30562:237 30575:249 30837:246 "
+      "32079:125 33709:3 34653:245 35313:247 36189:241", false },
+    { "WOZ-ssd1-8bit-ax3-ay2-sx1-sy2",           0xe281a2fb766013d8ull, "32160:113 32161:113", false },
+    { "WOZ-ssd1-8bit-ax2-ay3-sx3-sy1",           0x772a313db7a426e6ull, "13728:120", false },
+    { "WOZB-ssd0-8bit-ax1-ay1-sx1-sy1-bx1-by1",  0x5397a5aae7979cccull, nullptr, false },
+    { "WOZB-ssd0-8bit-ax1-ay1-sx1-sy1-bx0-by1",  0x352b8e2a39b83e13ull, nullptr, false },
+    { "WOZB-ssd0-8bit-ax3-ay2-sx1-sy2-bx1-by1",  0x3cf12d8c4a398da4ull, nullptr, false },
+    { "WOZB-ssd0-8bit-ax3-ay2-sx1-sy2-bx0-by1",  0x47c731c6416714d9ull, nullptr, false },
+    { "WOZB-ssd0-8bit-ax2-ay3-sx3-sy1-bx1-by1",  0x99c3f9510ecf2e68ull, nullptr, false },
+    { "WOZB-ssd0-8bit-ax2-ay3-sx3-sy1-bx0-by1",  0xe759bf7916dac81bull, nullptr, false },
+    { "WOZB-ssd1-8bit-ax1-ay1-sx1-sy1-bx1-by1",  0x2c59585c88f20635ull, nullptr, false },
+    { "WOZB-ssd1-8bit-ax1-ay1-sx1-sy1-bx0-by1",  0x94cd2656e350118dull, nullptr, false },
+    { "WOZB-ssd1-8bit-ax3-ay2-sx1-sy2-bx1-by1",  0xd3dc714a19c1333full, nullptr, false },
+    { "WOZB-ssd1-8bit-ax3-ay2-sx1-sy2-bx0-by1",  0x90cb2f81f41e6c75ull, nullptr, false },
+    { "WOZB-ssd1-8bit-ax2-ay3-sx3-sy1-bx1-by1",  0xf3ebf2996144afe4ull, nullptr, false },
+    { "WOZB-ssd1-8bit-ax2-ay3-sx3-sy1-bx0-by1",  0x242abb1765b99c85ull, nullptr, false },
+    { "WZ-ssd0-8bit-ax1-ay1-sx1-sy1",            0xbfcb7856548846d2ull, nullptr, false },
+    { "WZ-ssd0-8bit-ax3-ay2-sx1-sy2",            0x01fd6aedd99ef32aull, nullptr, false },
+    { "WZ-ssd0-8bit-ax2-ay3-sx3-sy1",            0x2e012ffa2ac89aa1ull, nullptr, false },
+    { "WZ-ssd1-8bit-ax1-ay1-sx1-sy1",            0xe501089168ea8292ull,
+      "1585:125 1587:123 2996:113 3002:189 3009:251 3089:237 4541:247 4542:8 4614:4 "
+      "4627:127 8438:163 29128:120 29143:8 29222:12 29231:247 29233:126 29238:122 "
+      "30670:247 32162:122 32259:248 32268:13 34547:139 34551:103 34554:103 34595:253 "
+      "36090:73", false },
+    { "WZ-ssd1-8bit-ax3-ay2-sx1-sy2",            0xb74b7ffb2bad147cull,
+      "1485:115 1487:130 1584:127 1586:119 2996:114 3003:205 4522:122 4612:243 4636:121 "
+      "6897:191 29122:123 29134:128 29143:8 29218:245 29233:125 29237:126 29240:118 "
+      "30645:193 36085:126", false },
+    { "WZ-ssd1-8bit-ax2-ay3-sx3-sy1",            0x4d59f36d8dc09e44ull,
+      "1480:126 3109:171 4525:118 4536:2 4636:121 6896:189 6899:160 8484:7 29123:120 "
+      "29225:246 29233:125 30645:194 32173:134 32256:11 34545:169 34548:123", false },
+    { "WZB-ssd0-8bit-ax1-ay1-sx1-sy1-bx1-by1",   0x985a75cfa5e48274ull, nullptr, false },
+    { "WZB-ssd0-8bit-ax1-ay1-sx1-sy1-bx0-by1",   0x60e270e319059680ull, nullptr, false },
+    { "WZB-ssd0-8bit-ax3-ay2-sx1-sy2-bx1-by1",   0x97f17909ad78f892ull, nullptr, false },
+    { "WZB-ssd0-8bit-ax3-ay2-sx1-sy2-bx0-by1",   0x3c96bb95c9fa2a79ull, nullptr, false },
+    { "WZB-ssd0-8bit-ax2-ay3-sx3-sy1-bx1-by1",   0xa64755f5db0972d8ull, nullptr, false },
+    { "WZB-ssd0-8bit-ax2-ay3-sx3-sy1-bx0-by1",   0xb68236355a7e2c6aull, nullptr, false },
+    { "WZB-ssd1-8bit-ax1-ay1-sx1-sy1-bx1-by1",   0xc68afc706a5dd191ull, nullptr, false },
+    { "WZB-ssd1-8bit-ax1-ay1-sx1-sy1-bx0-by1",   0x1b7f8f5e0d030cc3ull, nullptr, false },
+    { "WZB-ssd1-8bit-ax3-ay2-sx1-sy2-bx1-by1",   0x0adc6f08d804aa30ull, nullptr, false },
+    { "WZB-ssd1-8bit-ax3-ay2-sx1-sy2-bx0-by1",   0x96fd41cfd72d2d85ull, nullptr, false },
+    { "WZB-ssd1-8bit-ax2-ay3-sx3-sy1-bx1-by1",   0x5027e94b7b41c70aull, nullptr, false },
+    { "WZB-ssd1-8bit-ax2-ay3-sx3-sy1-bx0-by1",   0xaef881c069bb0883ull, nullptr, false },
+    { "WOZ-ssd0-10bit-ax1-ay1-sx1-sy1",          0xd6215da2373d80bfull, nullptr, false },
+    { "WOZ-ssd0-10bit-ax3-ay2-sx1-sy2",          0xfcd3863c89751004ull, nullptr, false },
+    { "WOZ-ssd0-10bit-ax2-ay3-sx3-sy1",          0x8f3f1911fff09358ull, nullptr, false },
+    { "WOZ-ssd1-10bit-ax1-ay1-sx1-sy1",          0x3972c5e219f1ad0full, "29039:576 36847:494", false },
+    { "WOZ-ssd1-10bit-ax3-ay2-sx1-sy2",          0x26522f40b2075ea5ull, nullptr, false },
+    { "WOZ-ssd1-10bit-ax2-ay3-sx3-sy1",          0x81f971ad8f33ac4cull, "8446:341 8447:341 34558:246 34559:246", false },
+    { "WOZB-ssd0-10bit-ax1-ay1-sx1-sy1-bx1-by1", 0xa41304be9d60389aull, nullptr, false },
+    { "WOZB-ssd0-10bit-ax1-ay1-sx1-sy1-bx0-by1", 0x1dad8adfbfe4276aull, nullptr, false },
+    { "WOZB-ssd0-10bit-ax3-ay2-sx1-sy2-bx1-by1", 0x1cd0b9a0f3e697f3ull, nullptr, false },
+    { "WOZB-ssd0-10bit-ax3-ay2-sx1-sy2-bx0-by1", 0x306da2b55c7540aeull, nullptr, false },
+    { "WOZB-ssd0-10bit-ax2-ay3-sx3-sy1-bx1-by1", 0xd6467c2ff8379930ull, nullptr, false },
+    { "WOZB-ssd0-10bit-ax2-ay3-sx3-sy1-bx0-by1", 0xabca83548e4b03c3ull, nullptr, false },
+    { "WOZB-ssd1-10bit-ax1-ay1-sx1-sy1-bx1-by1", 0x27537cdad3d08a1full, nullptr, false },
+    { "WOZB-ssd1-10bit-ax1-ay1-sx1-sy1-bx0-by1", 0xb6b5090c3ff09eb1ull, nullptr, false },
+    { "WOZB-ssd1-10bit-ax3-ay2-sx1-sy2-bx1-by1", 0x644bc22c4e953b00ull, nullptr, false },
+    { "WOZB-ssd1-10bit-ax3-ay2-sx1-sy2-bx0-by1", 0x0bca612d16c66575ull, nullptr, false },
+    { "WOZB-ssd1-10bit-ax2-ay3-sx3-sy1-bx1-by1", 0x85c89d69508a63adull, nullptr, false },
+    { "WOZB-ssd1-10bit-ax2-ay3-sx3-sy1-bx0-by1", 0x246a52bc676d26e8ull, nullptr, false },
+    { "WZ-ssd0-10bit-ax1-ay1-sx1-sy1",           0x0f11a711fea64b2eull, nullptr, false },
+    { "WZ-ssd0-10bit-ax3-ay2-sx1-sy2",           0xf6eb9c0d0cd2eb18ull, nullptr, false },
+    { "WZ-ssd0-10bit-ax2-ay3-sx3-sy1",           0xff5bdee7af0e99d2ull, nullptr, false },
+    { "WZ-ssd1-10bit-ax1-ay1-sx1-sy1",           0x3cad695adeb37b05ull,
+      "1472:426 1593:466 2992:376 4526:530 4527:531 4634:475 4635:486 8435:754 29130:581 "
+      "30642:632 30672:214 30758:473 30761:284 32170:471 32275:479 32286:451 34547:559 "
+      "34548:492 34550:483 36085:503", false },
+    { "WZ-ssd1-10bit-ax3-ay2-sx1-sy2",           0x6748e7f3132c0841ull,
+      "1485:463 1590:479 1597:547 1598:494 3005:807 4634:475 4636:483 4637:439 6897:764 "
+      "6902:665 8435:753 8440:538 29242:501 30642:631 30758:473 30765:205 30767:172 "
+      "32172:522 32174:484 34548:491", false },
+    { "WZ-ssd1-10bit-ax2-ay3-sx3-sy1",           0x50a9114ae7d33972ull,
+      "1584:508 1585:504 1593:466 2993:373 4515:515 4517:500 4634:475 4637:439 6899:643 "
+      "8433:749 8442:447 29122:491 32169:508 34550:484 34551:415 36085:503 36092:246", false },
+    { "WZB-ssd0-10bit-ax1-ay1-sx1-sy1-bx1-by1",  0x9c6b80d23ddeb4b8ull, nullptr, false },
+    { "WZB-ssd0-10bit-ax1-ay1-sx1-sy1-bx0-by1",  0x18d692c64229f483ull, nullptr, false },
+    { "WZB-ssd0-10bit-ax3-ay2-sx1-sy2-bx1-by1",  0xa3c70ae399a90338ull, nullptr, false },
+    { "WZB-ssd0-10bit-ax3-ay2-sx1-sy2-bx0-by1",  0x81fd01b0f7f82a7bull, nullptr, false },
+    { "WZB-ssd0-10bit-ax2-ay3-sx3-sy1-bx1-by1",  0x17f80ed5e95dff59ull, nullptr, false },
+    { "WZB-ssd0-10bit-ax2-ay3-sx3-sy1-bx0-by1",  0x8ee023e11e234891ull, nullptr, false },
+    { "WZB-ssd1-10bit-ax1-ay1-sx1-sy1-bx1-by1",  0x47efd7dc21155485ull, nullptr, false },
+    { "WZB-ssd1-10bit-ax1-ay1-sx1-sy1-bx0-by1",  0x034d35bcd1d58150ull, nullptr, false },
+    { "WZB-ssd1-10bit-ax3-ay2-sx1-sy2-bx1-by1",  0xd368466bdc42e916ull, nullptr, false },
+    { "WZB-ssd1-10bit-ax3-ay2-sx1-sy2-bx0-by1",  0xbb204f68f757c9f1ull, nullptr, false },
+    { "WZB-ssd1-10bit-ax2-ay3-sx3-sy1-bx1-by1",  0x9f680ac21672ec59ull, nullptr, false },
+    { "WZB-ssd1-10bit-ax2-ay3-sx3-sy1-bx0-by1",  0x9c82a0cf9475f0d9ull, nullptr, false },
+    { "WOZ-ssd0-16bit-ax1-ay1-sx1-sy1",          0x7d9d8d0563db014dull, nullptr, false },
+    { "WOZ-ssd0-16bit-ax3-ay2-sx1-sy2",          0xb13ea2f82a680d0dull, nullptr, false },
+    { "WOZ-ssd0-16bit-ax2-ay3-sx3-sy1",          0xa8e2f9c4cad03695ull, nullptr, false },
+    { "WOZ-ssd1-16bit-ax1-ay1-sx1-sy1",          0x7da546fb1b8836f1ull, nullptr, true  },
+    { "WOZ-ssd1-16bit-ax3-ay2-sx1-sy2",          0xa531dd3d5ad52385ull, nullptr, true  },
+    { "WOZ-ssd1-16bit-ax2-ay3-sx3-sy1",          0xd4efd9c7db148d1full, nullptr, true  },
+    { "WOZB-ssd0-16bit-ax1-ay1-sx1-sy1-bx1-by1", 0x4e059ca649c0d598ull, nullptr, false },
+    { "WOZB-ssd0-16bit-ax1-ay1-sx1-sy1-bx0-by1", 0xb00b37b609df9f1bull, nullptr, false },
+    { "WOZB-ssd0-16bit-ax3-ay2-sx1-sy2-bx1-by1", 0x74d33b4f68cd18caull, nullptr, false },
+    { "WOZB-ssd0-16bit-ax3-ay2-sx1-sy2-bx0-by1", 0xffe5c44d7ab4fddbull, nullptr, false },
+    { "WOZB-ssd0-16bit-ax2-ay3-sx3-sy1-bx1-by1", 0x71581c098b5c8d7cull, nullptr, false },
+    { "WOZB-ssd0-16bit-ax2-ay3-sx3-sy1-bx0-by1", 0x892f887166809597ull, nullptr, false },
+    { "WOZB-ssd1-16bit-ax1-ay1-sx1-sy1-bx1-by1", 0x3de91dcdbc54d4dfull, nullptr, true  },
+    { "WOZB-ssd1-16bit-ax1-ay1-sx1-sy1-bx0-by1", 0x620d2643465ea573ull, nullptr, true  },
+    { "WOZB-ssd1-16bit-ax3-ay2-sx1-sy2-bx1-by1", 0x49e8089b3527d4beull, nullptr, true  },
+    { "WOZB-ssd1-16bit-ax3-ay2-sx1-sy2-bx0-by1", 0x75bad51e721c56e7ull, nullptr, true  },
+    { "WOZB-ssd1-16bit-ax2-ay3-sx3-sy1-bx1-by1", 0x27ce095260a0b9c5ull, nullptr, true  },
+    { "WOZB-ssd1-16bit-ax2-ay3-sx3-sy1-bx0-by1", 0xd13e8e74875fb501ull, nullptr, true  },
+    { "WZ-ssd0-16bit-ax1-ay1-sx1-sy1",           0x0efb6c68ce2471a5ull, nullptr, false },
+    { "WZ-ssd0-16bit-ax3-ay2-sx1-sy2",           0x813720228a70ee09ull, nullptr, false },
+    { "WZ-ssd0-16bit-ax2-ay3-sx3-sy1",           0x46bbf88d9d52fcfdull, nullptr, false },
+    { "WZ-ssd1-16bit-ax1-ay1-sx1-sy1",           0x3a0f8c9cea782b3eull, nullptr, true  },
+    { "WZ-ssd1-16bit-ax3-ay2-sx1-sy2",           0x3418476cabd826e7ull, nullptr, true  },
+    { "WZ-ssd1-16bit-ax2-ay3-sx3-sy1",           0x77c1ebe476f38412ull, nullptr, true  },
+    { "WZB-ssd0-16bit-ax1-ay1-sx1-sy1-bx1-by1",  0xf65877ce1130dcf8ull, nullptr, false },
+    { "WZB-ssd0-16bit-ax1-ay1-sx1-sy1-bx0-by1",  0x569a7d84f124203eull, nullptr, false },
+    { "WZB-ssd0-16bit-ax3-ay2-sx1-sy2-bx1-by1",  0x775b64234d70e531ull, nullptr, false },
+    { "WZB-ssd0-16bit-ax3-ay2-sx1-sy2-bx0-by1",  0xb1c9a3377af8b734ull, nullptr, false },
+    { "WZB-ssd0-16bit-ax2-ay3-sx3-sy1-bx1-by1",  0xcfd51a4edc3d64a0ull, nullptr, false },
+    { "WZB-ssd0-16bit-ax2-ay3-sx3-sy1-bx0-by1",  0x982ec619479022f7ull, nullptr, false },
+    { "WZB-ssd1-16bit-ax1-ay1-sx1-sy1-bx1-by1",  0xdfdd5311544a1a11ull, nullptr, true  },
+    { "WZB-ssd1-16bit-ax1-ay1-sx1-sy1-bx0-by1",  0x1c00c31b7cd23553ull, nullptr, true  },
+    { "WZB-ssd1-16bit-ax3-ay2-sx1-sy2-bx1-by1",  0x2c3d62ed6bd3c2e2ull, nullptr, true  },
+    { "WZB-ssd1-16bit-ax3-ay2-sx1-sy2-bx0-by1",  0x364ff382a5e344daull, nullptr, true  },
+    { "WZB-ssd1-16bit-ax2-ay3-sx3-sy1-bx1-by1",  0xebb6f2a915aedb93ull, nullptr, true  },
+    { "WZB-ssd1-16bit-ax2-ay3-sx3-sy1-bx0-by1",  0x0fbfcc896d814c69ull, nullptr, true  },
+};
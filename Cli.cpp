@@ -0,0 +1,463 @@
+/*****************************************************************************
+ * Cli.cpp
+ *****************************************************************************
+ * Command-line front end of the TNLMeans filter.
+ *
+ * Reads Y4M (or raw planar video) from stdin and writes the denoised video
+ * as Y4M to stdout, without VapourSynth. Frames are read ahead by a reader
+ * thread, filtered by a pool of workers and written in order, with a fixed
+ * number of frames in flight, so memory does not grow with the clip length.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "TNLMeans.h"
+
+/*----------------------------------------------------------------------------
+ * Frames
+ *--------------------------------------------------------------------------*/
+class Picture : public nlPicture
+{
+private:
+    std::vector< uint8_t > data;
+public:
+    size_t size[3];
+    Picture( const nlVideoInfo &vi )
+    {
+        size_t total = 0;
+        for( int i = 0; i < vi.format.numPlanes; ++i )
+        {
+            width [i] = vi.width  >> (i ? vi.format.subSamplingW : 0);
+            height[i] = vi.height >> (i ? vi.format.subSamplingH : 0);
+            stride[i] = width[i] * vi.format.bytesPerSample;
+            size  [i] = static_cast<size_t>(stride[i]) * height[i];
+            total += size[i];
+        }
+        data.resize( total );
+        uint8_t *p = data.data();
+        for( int i = 0; i < vi.format.numPlanes; ++i )
+        {
+            rptr[i] = wptr[i] = p;
+            p += size[i];
+        }
+    }
+    uint8_t *buffer() { return data.data(); }
+    size_t   bytes () { return data.size(); }
+};
+
+/*----------------------------------------------------------------------------
+ * Y4M
+ *--------------------------------------------------------------------------*/
+/* Chroma layouts and sample sizes as named by the C tag of Y4M, e.g. 420,
+ * 420jpeg, 420p10, 444p16, mono, mono16. */
+static bool parse_colorspace( const std::string &c, nlFormat &format )
+{
+    static const struct { const char *name; int planes, ssw, ssh; } layouts[] =
+    {
+        { "420", 3, 1, 1 }, { "422", 3, 1, 0 }, { "444", 3, 0, 0 }, { "411", 3, 2, 0 }, { "mono", 1, 0, 0 }
+    };
+    for( const auto &l : layouts )
+    {
+        const std::string name = l.name;
+        if( c.compare( 0, name.size(), name ) != 0 )
+            continue;
+        std::string rest = c.substr( name.size() );
+        int bits = 8;
+        if( rest == "jpeg" || rest == "paldv" || rest == "mpeg2" )
+            rest.clear();
+        if( !rest.empty() )
+        {
+            if( rest[0] == 'p' && l.planes == 3 )
+                rest = rest.substr( 1 );
+            char *end;
+            bits = static_cast<int>(strtol( rest.c_str(), &end, 10 ));
+            if( *end || bits < 8 || bits > 16 )
+                return false;
+        }
+        format.numPlanes      = l.planes;
+        format.bitsPerSample  = bits;
+        format.bytesPerSample = bits > 8 ? 2 : 1;
+        format.subSamplingW   = l.planes == 3 ? l.ssw : 0;
+        format.subSamplingH   = l.planes == 3 ? l.ssh : 0;
+        return true;
+    }
+    return false;
+}
+
+static bool read_line( FILE *fp, std::string &line )
+{
+    line.clear();
+    for( int c; (c = fgetc( fp )) != EOF; )
+    {
+        if( c == '\n' )
+            return true;
+        line += static_cast<char>(c);
+        if( line.size() > 4096 )
+            return false;
+    }
+    return false;
+}
+
+/* Parse the stream header and return the header to write. */
+static bool read_header( FILE *fp, nlVideoInfo &vi, std::string &header )
+{
+    std::string line;
+    if( !read_line( fp, line ) || line.compare( 0, 10, "YUV4MPEG2 " ) != 0 )
+        return false;
+    std::string colorspace = "420";
+    vi.width = vi.height = 0;
+    size_t pos = 9;
+    while( pos < line.size() )
+    {
+        const size_t end = std::min( line.find( ' ', pos + 1 ), line.size() );
+        const std::string tag = line.substr( pos + 1, end - pos - 1 );
+        pos = end;
+        if( tag.empty() )
+            continue;
+        if( tag[0] == 'W' ) vi.width  = atoi( tag.c_str() + 1 );
+        if( tag[0] == 'H' ) vi.height = atoi( tag.c_str() + 1 );
+        if( tag[0] == 'C' ) colorspace = tag.substr( 1 );
+    }
+    header = line;
+    return vi.width > 0 && vi.height > 0 && parse_colorspace( colorspace, vi.format );
+}
+
+static bool read_frame( FILE *fp, bool y4m, Picture *pic )
+{
+    if( y4m )
+    {
+        std::string line;
+        if( !read_line( fp, line ) || line.compare( 0, 5, "FRAME" ) != 0 )
+            return false;
+    }
+    return fread( pic->buffer(), 1, pic->bytes(), fp ) == pic->bytes();
+}
+
+/*----------------------------------------------------------------------------
+ * Pipeline
+ *--------------------------------------------------------------------------*/
+/* Frames are read into a ring of 'inputs' entries and filtered into a ring of
+ * 'outputs' entries, which are written in order. A frame stays in the input
+ * ring until every output that searches it has been written, so the reader
+ * keeps az frames ahead of the newest output being filtered. The length of
+ * the clip is only known once the input ends; until then the filter is told
+ * the clip is endless, and no frame near the end is started before it knows.
+ * The filter is then given the length under the lock, which every worker takes
+ * to start a frame. Each input entry records the number of its frame, so a
+ * request for a frame no longer or not yet in the ring fails instead of
+ * returning another. */
+class Pipeline : public nlProvider
+{
+public:
+    std::mutex mtx;
+    std::vector< const nlPicture * > input;
+    std::vector< int >               input_n;
+    std::vector< const nlPicture * > output;
+    int  inputs;
+    int  outputs;
+    int  read      = 0;     /* frames read */
+    int  next      = 0;     /* next frame to be filtered */
+    int  written   = 0;     /* frames written */
+    int  in_flight = 0;
+    int  length    = -1;    /* known at the end of the input */
+    bool eof       = false;
+    bool failed    = false;
+    Pipeline( int _inputs, int _outputs ) : input( _inputs, nullptr ), input_n( _inputs, -1 ), output( _outputs, nullptr ), inputs( _inputs ), outputs( _outputs ) {}
+    ~Pipeline()
+    {
+        for( const nlPicture *p : input )  if( p ) p->release();
+        for( const nlPicture *p : output ) if( p ) p->release();
+    }
+    const nlPicture *fetch( int n, bool )
+    {
+        std::lock_guard< std::mutex > lock( mtx );
+        if( n < 0 || input_n[n % inputs] != n )
+            return nullptr;
+        return input[n % inputs]->retain();
+    }
+};
+
+/* Poll until pred, taken under the lock of the pipeline, returns true. */
+template < typename Pred >
+static void wait_for( Pipeline &pipe, Pred pred )
+{
+    for( int spins = 0; ; ++spins )
+    {
+        {
+            std::lock_guard< std::mutex > lock( pipe.mtx );
+            if( pred() )
+                return;
+        }
+        if( spins < 64 )
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for( std::chrono::microseconds( 200 ) );
+    }
+}
+
+static void reader( Pipeline &pipe, TNLMeans &filter, FILE *fp, bool y4m, int Az )
+{
+    for( int i = 0; ; ++i )
+    {
+        bool stop = false;
+        wait_for( pipe, [&]() { stop = pipe.failed; return stop || i < pipe.written - Az + pipe.inputs; } );
+        if( stop )
+            return;
+        Picture *pic = new ( std::nothrow ) Picture( filter.vi );
+        if( pic == nullptr || !read_frame( fp, y4m, pic ) )
+        {
+            if( pic )
+                pic->release();
+            break;
+        }
+        std::lock_guard< std::mutex > lock( pipe.mtx );
+        if( pipe.input[i % pipe.inputs] )
+            pipe.input[i % pipe.inputs]->release();
+        pipe.input  [i % pipe.inputs] = pic;
+        pipe.input_n[i % pipe.inputs] = i;
+        pipe.read = i + 1;
+    }
+    {
+        std::lock_guard< std::mutex > lock( pipe.mtx );
+        pipe.eof = true;
+    }
+    /* No frame is started while eof is set and the length is unknown, so the
+     * length can be handed to the filter once the running ones are done. */
+    wait_for( pipe, [&]() { return pipe.in_flight == 0; } );
+    std::lock_guard< std::mutex > lock( pipe.mtx );
+    filter.vi.numFrames = std::max( pipe.read, 1 );
+    pipe.length = pipe.read;
+}
+
+static void worker( Pipeline &pipe, TNLMeans &filter, int Az )
+{
+    for( ; ; )
+    {
+        int  n    = -1;
+        bool stop = false;
+        wait_for( pipe, [&]()
+        {
+            if( pipe.failed || (pipe.length >= 0 && pipe.next >= pipe.length) )
+                return stop = true;
+            if( pipe.next - pipe.written >= pipe.outputs )
+                return false;
+            if( pipe.length < 0 && (pipe.eof || pipe.read <= pipe.next + Az) )
+                return false;
+            n = pipe.next++;
+            ++pipe.in_flight;
+            return true;
+        } );
+        if( stop )
+            return;
+        const nlPicture *pic = nullptr;
+        try
+        {
+            nlReport report;
+            pic = new Picture( filter.vi );
+            filter.GetFrame( n, pic, &pipe, &report );
+        }
+        catch( ... )
+        {
+            fprintf( stderr, "tnlm-cli: failed to filter frame %d\n", n );
+            if( pic )
+                pic->release();
+            pic = nullptr;
+        }
+        std::lock_guard< std::mutex > lock( pipe.mtx );
+        --pipe.in_flight;
+        if( pic )
+            pipe.output[n % pipe.outputs] = pic;
+        else
+            pipe.failed = true;
+    }
+}
+
+/*----------------------------------------------------------------------------
+ * Main
+ *--------------------------------------------------------------------------*/
+static void usage()
+{
+    fprintf( stderr,
+        "Usage: tnlm-cli [options] [key=value ...] < input > output.y4m\n"
+        "Reads Y4M from stdin and writes the denoised Y4M to stdout.\n"
+        "options:\n"
+        "  -t THREADS          frames filtered in parallel     [number of CPUs]\n"
+        "  -s WxH              read raw planar video of this size instead of Y4M\n"
+        "  -c COLORSPACE       colorspace of raw video, as the Y4M C tag  [420]\n"
+        "  -r NUM:DEN          frame rate written for raw video           [25:1]\n"
+        "key=value pairs set the parameters of TNLMeans, e.g. ax=4 az=1 h=1.5.\n" );
+}
+
+int main( int argc, char **argv )
+{
+    std::map< std::string, std::string > args;
+    std::string size;
+    std::string colorspace = "420";
+    std::string rate       = "25:1";
+    int threads = std::max( static_cast<int>(std::thread::hardware_concurrency()), 1 );
+    for( int i = 1; i < argc; ++i )
+    {
+        const std::string arg = argv[i];
+        const size_t eq = arg.find( '=' );
+        if( arg == "-h" || arg == "--help" ) { usage(); return 0; }
+        else if( arg == "-t" && i + 1 < argc ) threads    = std::max( atoi( argv[++i] ), 1 );
+        else if( arg == "-s" && i + 1 < argc ) size       = argv[++i];
+        else if( arg == "-c" && i + 1 < argc ) colorspace = argv[++i];
+        else if( arg == "-r" && i + 1 < argc ) rate       = argv[++i];
+        else if( eq != std::string::npos )     args[arg.substr( 0, eq )] = arg.substr( eq + 1 );
+        else { usage(); return 1; }
+    }
+    auto get = [&]( const char *key, double default_value )
+    {
+        auto it = args.find( key );
+        if( it == args.end() )
+            return default_value;
+        const double value = atof( it->second.c_str() );
+        args.erase( it );
+        return value;
+    };
+    const int    ax         = static_cast<int>(get( "ax", 4 ));
+    const int    ay         = static_cast<int>(get( "ay", 4 ));
+    const int    az         = static_cast<int>(get( "az", 0 ));
+    const int    sx         = static_cast<int>(get( "sx", 2 ));
+    const int    sy         = static_cast<int>(get( "sy", 2 ));
+    const int    bx         = static_cast<int>(get( "bx", 1 ));
+    const int    by         = static_cast<int>(get( "by", 1 ));
+    const double a          = get( "a", 1.0 );
+    const double h          = get( "h", 0.5 );
+    const double hauto      = get( "hauto", 0.0 );
+    const int    ssd        = static_cast<int>(get( "ssd", 1 ));
+    const int    me         = static_cast<int>(get( "me", 0 ));
+    const int    meblock    = static_cast<int>(get( "meblock", 16 ));
+    const int    recursive  = static_cast<int>(get( "recursive", 0 ));
+    const int    sequential = static_cast<int>(get( "sequential", 0 ));
+    const int    flat       = static_cast<int>(get( "flat", 0 ));
+    const int    hugepages  = static_cast<int>(get( "hugepages", 0 ));
+    const int    numa       = static_cast<int>(get( "numa", 1 ));
+    const int    max_memory = static_cast<int>(get( "max_memory", 0 ));
+    const int    simd       = static_cast<int>(get( "simd", -1 ));
+    if( !args.empty() )
+    {
+        fprintf( stderr, "tnlm-cli: unknown parameter %s\n", args.begin()->first.c_str() );
+        return 1;
+    }
+    /* The recursive mode needs the frames filtered one after another. */
+    if( recursive )
+        threads = 1;
+
+#ifdef _WIN32
+    _setmode( _fileno( stdin ),  _O_BINARY );
+    _setmode( _fileno( stdout ), _O_BINARY );
+#endif
+
+    nlVideoInfo vi;
+    std::string header;
+    const bool y4m = size.empty();
+    if( y4m )
+    {
+        if( !read_header( stdin, vi, header ) )
+        {
+            fprintf( stderr, "tnlm-cli: unsupported or invalid Y4M header\n" );
+            return 1;
+        }
+    }
+    else
+    {
+        if( sscanf( size.c_str(), "%dx%d", &vi.width, &vi.height ) != 2 || vi.width <= 0 || vi.height <= 0
+         || !parse_colorspace( colorspace, vi.format ) )
+        {
+            fprintf( stderr, "tnlm-cli: invalid size or colorspace\n" );
+            return 1;
+        }
+        header = "YUV4MPEG2 W" + std::to_string( vi.width ) + " H" + std::to_string( vi.height )
+               + " F" + rate + " Ip A1:1 C" + colorspace;
+    }
+    if( (vi.width  & ((1 << vi.format.subSamplingW) - 1))
+     || (vi.height & ((1 << vi.format.subSamplingH) - 1)) )
+    {
+        fprintf( stderr, "tnlm-cli: dimensions must be multiples of the chroma subsampling\n" );
+        return 1;
+    }
+    vi.numFrames = INT_MAX / 2;
+
+    std::unique_ptr< TNLMeans > filter;
+    try
+    {
+        filter.reset( new TNLMeans( ax, ay, az, sx, sy, bx, by, a, h, hauto, ssd != 0, me, meblock, recursive != 0, sequential != 0,
+                                    flat, hugepages != 0, numa != 0, max_memory, simd, vi, threads, false ) );
+    }
+    catch( TNLMeans::bad_param &e )
+    {
+        fprintf( stderr, "tnlm-cli: %s\n", e.what() );
+        return 1;
+    }
+    catch( ... )
+    {
+        fprintf( stderr, "tnlm-cli: allocation failure\n" );
+        return 1;
+    }
+
+    Pipeline pipe( threads * 2 + az * 2 + 1, threads * 2 );
+    std::vector< std::thread > workers;
+    std::thread input( reader, std::ref( pipe ), std::ref( *filter ), stdin, y4m, az );
+    for( int i = 0; i < threads; ++i )
+        workers.emplace_back( worker, std::ref( pipe ), std::ref( *filter ), az );
+
+    bool ok = fprintf( stdout, "%s\n", header.c_str() ) > 0;
+    for( ; ok ; )
+    {
+        const nlPicture *pic  = nullptr;
+        bool             done = false;
+        wait_for( pipe, [&]()
+        {
+            done = pipe.failed || pipe.written == pipe.length;
+            pic  = pipe.output[pipe.written % pipe.outputs];
+            return done || pic;
+        } );
+        if( done )
+            break;
+        const Picture *out = static_cast<const Picture *>(pic);
+        ok = fputs( "FRAME\n", stdout ) >= 0;
+        for( int i = 0; ok && i < vi.format.numPlanes; ++i )
+            ok = fwrite( out->rptr[i], 1, out->size[i], stdout ) == out->size[i];
+        std::lock_guard< std::mutex > lock( pipe.mtx );
+        pipe.output[pipe.written % pipe.outputs] = nullptr;
+        pic->release();
+        ++pipe.written;
+    }
+    ok = fflush( stdout ) == 0 && ok;
+    {
+        std::lock_guard< std::mutex > lock( pipe.mtx );
+        if( !ok )
+            pipe.failed = true;
+        ok = !pipe.failed;
+    }
+    input.join();
+    for( std::thread &w : workers )
+        w.join();
+    if( !ok )
+        fprintf( stderr, "tnlm-cli: stopped after %d frames\n", pipe.written );
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,366 @@
+/*****************************************************************************
+ * Kernels.cpp
+ *****************************************************************************
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+#include <cstdint>
+#include <cstring>
+
+#include "Kernels.h"
+
+/* The x86 kernels are compiled for their instruction set per function, so
+ * the rest of the filter keeps running on any CPU. */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define NL_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#ifdef NL_X86_KERNELS
+
+#define NL_TARGET_AVX2   __attribute__(( target( "avx2" ) ))
+#define NL_TARGET_AVX512 __attribute__(( target( "avx2,avx512f,avx512bw,avx512vl" ) ))
+
+/* Four samples as 32-bit integers. Only the four samples are read. */
+NL_TARGET_AVX2 static inline __m128i load4( const uint8_t *p )
+{
+    int32_t v;
+    std::memcpy( &v, p, sizeof(v) );
+    return _mm_cvtepu8_epi32( _mm_cvtsi32_si128( v ) );
+}
+
+NL_TARGET_AVX2 static inline __m128i load4( const uint16_t *p )
+{
+    return _mm_cvtepu16_epi32( _mm_loadl_epi64( reinterpret_cast<const __m128i *>(p) ) );
+}
+
+template < int ssd, typename pixel >
+NL_TARGET_AVX2 static double distance_avx2
+(
+    const void   *s1v,
+    const void   *s2v,
+    int           pitch,
+    const double *gw,
+    int           gwpitch,
+    int           xL,
+    int           xR,
+    int           rows,
+    double       *gweights
+)
+{
+    const uint8_t *s1 = static_cast<const uint8_t *>(s1v);
+    const uint8_t *s2 = static_cast<const uint8_t *>(s2v);
+    __m256d diff = _mm256_setzero_pd(), gws = _mm256_setzero_pd();
+    double  difft = 0.0, gwt = 0.0;
+    for( int j = 0; j < rows; ++j )
+    {
+        const pixel *p1 = reinterpret_cast<const pixel *>(s1);
+        const pixel *p2 = reinterpret_cast<const pixel *>(s2);
+        int k = xL;
+        for( ; k + 3 <= xR; k += 4 )
+        {
+            const __m128i d  = _mm_sub_epi32( load4( p1 + k ), load4( p2 + k ) );
+            const __m256d dd = _mm256_cvtepi32_pd( ssd ? d : _mm_abs_epi32( d ) );
+            const __m256d g  = _mm256_loadu_pd( gw + k );
+            diff = _mm256_add_pd( diff, _mm256_mul_pd( ssd ? _mm256_mul_pd( dd, dd ) : dd, g ) );
+            gws  = _mm256_add_pd( gws, g );
+        }
+        for( ; k <= xR; ++k )
+        {
+            const double d = static_cast<int>(p1[k]) - static_cast<int>(p2[k]);
+            difft += (ssd ? d * d : (d < 0 ? -d : d)) * gw[k];
+            gwt   += gw[k];
+        }
+        s1 += pitch;
+        s2 += pitch;
+        gw += gwpitch;
+    }
+    alignas(32) double lanes[4];
+    _mm256_store_pd( lanes, gws );
+    *gweights += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + gwt;
+    _mm256_store_pd( lanes, diff );
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + difft;
+}
+
+/* Eight samples as 32-bit integers. Masked out samples are not read, so the
+ * clamped edges of a patch need no scalar tail. */
+NL_TARGET_AVX512 static inline __m256i load8( const uint8_t *p, __mmask8 m )
+{
+    return _mm256_cvtepu8_epi32( _mm_maskz_loadu_epi8( m, p ) );
+}
+
+NL_TARGET_AVX512 static inline __m256i load8( const uint16_t *p, __mmask8 m )
+{
+    return _mm256_cvtepu16_epi32( _mm_maskz_loadu_epi16( m, p ) );
+}
+
+/* Eight 32-bit integers as doubles. GCC's unmasked conversion starts from an
+ * undefined vector, which -Wmaybe-uninitialized reports once it is inlined,
+ * so the zero-masked form is used with every lane set. */
+NL_TARGET_AVX512 static inline __m512d to_pd( __m256i v )
+{
+    return _mm512_maskz_cvtepi32_pd( 0xFF, v );
+}
+
+/* Sum of the lanes, paired as _mm512_reduce_add_pd does, whose extraction of
+ * the upper half trips the same warning. */
+NL_TARGET_AVX512 static inline double sum_pd( __m512d v )
+{
+    alignas( 64 ) double l[8];
+    _mm512_store_pd( l, v );
+    return ((l[0] + l[4]) + (l[2] + l[6])) + ((l[1] + l[5]) + (l[3] + l[7]));
+}
+
+NL_TARGET_AVX512 static inline __mmask8 mask8( int left )
+{
+    return left >= 8 ? 0xFF : static_cast<__mmask8>((1u << left) - 1);
+}
+
+template < int ssd, typename pixel >
+NL_TARGET_AVX512 static double distance_avx512
+(
+    const void   *s1v,
+    const void   *s2v,
+    int           pitch,
+    const double *gw,
+    int           gwpitch,
+    int           xL,
+    int           xR,
+    int           rows,
+    double       *gweights
+)
+{
+    const uint8_t *s1 = static_cast<const uint8_t *>(s1v);
+    const uint8_t *s2 = static_cast<const uint8_t *>(s2v);
+    __m512d diff = _mm512_setzero_pd(), gws = _mm512_setzero_pd();
+    for( int j = 0; j < rows; ++j )
+    {
+        const pixel *p1 = reinterpret_cast<const pixel *>(s1);
+        const pixel *p2 = reinterpret_cast<const pixel *>(s2);
+        for( int k = xL; k <= xR; k += 8 )
+        {
+            const __mmask8 m  = mask8( xR - k + 1 );
+            const __m256i  d  = _mm256_sub_epi32( load8( p1 + k, m ), load8( p2 + k, m ) );
+            const __m512d  dd = to_pd( ssd ? d : _mm256_abs_epi32( d ) );
+            const __m512d  g  = _mm512_maskz_loadu_pd( m, gw + k );
+            diff = _mm512_add_pd( diff, _mm512_mul_pd( ssd ? _mm512_mul_pd( dd, dd ) : dd, g ) );
+            gws  = _mm512_add_pd( gws, g );
+        }
+        s1 += pitch;
+        s2 += pitch;
+        gw += gwpitch;
+    }
+    *gweights += sum_pd( gws );
+    return sum_pd( diff );
+}
+
+/* Distance of a single patch in the order of the generic loop, for the
+ * candidates of a strip that do not fill the lanes. */
+template < int ssd, typename pixel >
+static double distance_one( const uint8_t *s1, const uint8_t *s2, int pitch, const double *gw, int gwpitch, int xL, int xR, int rows )
+{
+    double diff = 0.0;
+    for( int j = 0; j < rows; ++j )
+    {
+        const pixel *p1 = reinterpret_cast<const pixel *>(s1);
+        const pixel *p2 = reinterpret_cast<const pixel *>(s2);
+        for( int k = xL; k <= xR; ++k )
+        {
+            const double d = static_cast<int>(p1[k]) - static_cast<int>(p2[k]);
+            diff += (ssd ? d * d : (d < 0 ? -d : d)) * gw[k];
+        }
+        s1 += pitch;
+        s2 += pitch;
+        gw += gwpitch;
+    }
+    return diff;
+}
+
+/* The strip kernels put one candidate in each lane: a sample of s2 and its
+ * weight are broadcast once and meet the samples of s1 that follow it in the
+ * row, so each lane adds the terms of its patch in the generic order. */
+template < int ssd, int lanes, typename pixel >
+NL_TARGET_AVX2 static void strip_avx2_n( const uint8_t *s1, const uint8_t *s2, int pitch, const double *gw, int gwpitch,
+                                         int xL, int xR, int rows, double *diffs )
+{
+    __m256d diff0 = _mm256_setzero_pd(), diff1 = _mm256_setzero_pd();
+    for( int j = 0; j < rows; ++j )
+    {
+        const pixel *p1 = reinterpret_cast<const pixel *>(s1);
+        const pixel *p2 = reinterpret_cast<const pixel *>(s2);
+        for( int k = xL; k <= xR; ++k )
+        {
+            const __m128i r  = _mm_set1_epi32( p2[k] );
+            const __m256d g  = _mm256_broadcast_sd( gw + k );
+            const __m128i d0 = _mm_sub_epi32( load4( p1 + k ), r );
+            const __m256d a0 = _mm256_cvtepi32_pd( ssd ? d0 : _mm_abs_epi32( d0 ) );
+            diff0 = _mm256_add_pd( diff0, _mm256_mul_pd( ssd ? _mm256_mul_pd( a0, a0 ) : a0, g ) );
+            if( lanes == 8 )
+            {
+                const __m128i d1 = _mm_sub_epi32( load4( p1 + k + 4 ), r );
+                const __m256d a1 = _mm256_cvtepi32_pd( ssd ? d1 : _mm_abs_epi32( d1 ) );
+                diff1 = _mm256_add_pd( diff1, _mm256_mul_pd( ssd ? _mm256_mul_pd( a1, a1 ) : a1, g ) );
+            }
+        }
+        s1 += pitch;
+        s2 += pitch;
+        gw += gwpitch;
+    }
+    _mm256_storeu_pd( diffs, diff0 );
+    if( lanes == 8 )
+        _mm256_storeu_pd( diffs + 4, diff1 );
+}
+
+template < int ssd, typename pixel >
+NL_TARGET_AVX2 static void strip_avx2
+(
+    const void   *s1v,
+    const void   *s2v,
+    int           pitch,
+    const double *gw,
+    int           gwpitch,
+    int           xL,
+    int           xR,
+    int           rows,
+    int           count,
+    double       *diffs
+)
+{
+    const uint8_t *s1 = static_cast<const uint8_t *>(s1v);
+    const uint8_t *s2 = static_cast<const uint8_t *>(s2v);
+    int i = 0;
+    for( ; i + 8 <= count; i += 8 )
+        strip_avx2_n< ssd, 8, pixel >( s1 + i * sizeof( pixel ), s2, pitch, gw, gwpitch, xL, xR, rows, diffs + i );
+    if( i + 4 <= count )
+    {
+        strip_avx2_n< ssd, 4, pixel >( s1 + i * sizeof( pixel ), s2, pitch, gw, gwpitch, xL, xR, rows, diffs + i );
+        i += 4;
+    }
+    for( ; i < count; ++i )
+        diffs[i] = distance_one< ssd, pixel >( s1 + i * sizeof( pixel ), s2, pitch, gw, gwpitch, xL, xR, rows );
+}
+
+static const nlKernels kernels_avx2 =
+{
+    "avx2",
+    {
+        { distance_avx2< 0, uint8_t >, distance_avx2< 0, uint16_t > },
+        { distance_avx2< 1, uint8_t >, distance_avx2< 1, uint16_t > }
+    },
+    {
+        { strip_avx2< 0, uint8_t >, strip_avx2< 0, uint16_t > },
+        { strip_avx2< 1, uint8_t >, strip_avx2< 1, uint16_t > }
+    }
+};
+
+template < int ssd, int lanes, typename pixel >
+NL_TARGET_AVX512 static void strip_avx512_n( const uint8_t *s1, const uint8_t *s2, int pitch, const double *gw, int gwpitch,
+                                             int xL, int xR, int rows, int count, double *diffs )
+{
+    const __mmask8 m0 = mask8( count ), m1 = lanes == 16 ? mask8( count - 8 ) : 0;
+    __m512d diff0 = _mm512_setzero_pd(), diff1 = _mm512_setzero_pd();
+    for( int j = 0; j < rows; ++j )
+    {
+        const pixel *p1 = reinterpret_cast<const pixel *>(s1);
+        const pixel *p2 = reinterpret_cast<const pixel *>(s2);
+        for( int k = xL; k <= xR; ++k )
+        {
+            const __m256i r  = _mm256_set1_epi32( p2[k] );
+            const __m512d g  = _mm512_set1_pd( gw[k] );
+            const __m256i d0 = _mm256_sub_epi32( load8( p1 + k, m0 ), r );
+            const __m512d a0 = to_pd( ssd ? d0 : _mm256_abs_epi32( d0 ) );
+            diff0 = _mm512_add_pd( diff0, _mm512_mul_pd( ssd ? _mm512_mul_pd( a0, a0 ) : a0, g ) );
+            if( lanes == 16 )
+            {
+                const __m256i d1 = _mm256_sub_epi32( load8( p1 + k + 8, m1 ), r );
+                const __m512d a1 = to_pd( ssd ? d1 : _mm256_abs_epi32( d1 ) );
+                diff1 = _mm512_add_pd( diff1, _mm512_mul_pd( ssd ? _mm512_mul_pd( a1, a1 ) : a1, g ) );
+            }
+        }
+        s1 += pitch;
+        s2 += pitch;
+        gw += gwpitch;
+    }
+    _mm512_mask_storeu_pd( diffs, m0, diff0 );
+    if( lanes == 16 )
+        _mm512_mask_storeu_pd( diffs + 8, m1, diff1 );
+}
+
+template < int ssd, typename pixel >
+NL_TARGET_AVX512 static void strip_avx512
+(
+    const void   *s1v,
+    const void   *s2v,
+    int           pitch,
+    const double *gw,
+    int           gwpitch,
+    int           xL,
+    int           xR,
+    int           rows,
+    int           count,
+    double       *diffs
+)
+{
+    const uint8_t *s1 = static_cast<const uint8_t *>(s1v);
+    const uint8_t *s2 = static_cast<const uint8_t *>(s2v);
+    for( int i = 0; i < count; i += 16 )
+    {
+        if( count - i > 8 )
+            strip_avx512_n< ssd, 16, pixel >( s1 + i * sizeof( pixel ), s2, pitch, gw, gwpitch, xL, xR, rows, count - i, diffs + i );
+        else
+            strip_avx512_n< ssd,  8, pixel >( s1 + i * sizeof( pixel ), s2, pitch, gw, gwpitch, xL, xR, rows, count - i, diffs + i );
+    }
+}
+
+static const nlKernels kernels_avx512 =
+{
+    "avx512",
+    {
+        { distance_avx512< 0, uint8_t >, distance_avx512< 0, uint16_t > },
+        { distance_avx512< 1, uint8_t >, distance_avx512< 1, uint16_t > }
+    },
+    {
+        { strip_avx512< 0, uint8_t >, strip_avx512< 0, uint16_t > },
+        { strip_avx512< 1, uint8_t >, strip_avx512< 1, uint16_t > }
+    }
+};
+
+#endif
+
+static const nlKernels kernels_none =
+{
+    "none",
+    { { nullptr, nullptr }, { nullptr, nullptr } },
+    { { nullptr, nullptr }, { nullptr, nullptr } }
+};
+
+const nlKernels &nlSelectKernels( int simd )
+{
+#ifdef NL_X86_KERNELS
+    __builtin_cpu_init();
+    const bool avx2   = __builtin_cpu_supports( "avx2" );
+    const bool avx512 = avx2 && __builtin_cpu_supports( "avx512f" )
+                     && __builtin_cpu_supports( "avx512bw" ) && __builtin_cpu_supports( "avx512vl" );
+    /* Skylake and Cascade Lake server parts run at a lower clock licence while
+     * 512-bit instructions are in use, which costs more than they gain here. */
+    if( simd == SIMD_AUTO )
+        simd = (__builtin_cpu_is( "skylake-avx512" ) || __builtin_cpu_is( "cascadelake" )) ? SIMD_AVX2 : SIMD_AVX512;
+    if( simd >= SIMD_AVX512 && avx512 )
+        return kernels_avx512;
+    if( simd >= SIMD_AVX2 && avx2 )
+        return kernels_avx2;
+#else
+    (void)simd;
+#endif
+    return kernels_none;
+}
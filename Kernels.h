@@ -0,0 +1,46 @@
+/*****************************************************************************
+ * Kernels.h
+ *****************************************************************************
+ * Innermost loops of the filter in variants for the instruction sets of the
+ * CPU. A table of them is chosen once per filter; an entry left nullptr
+ * means the engines use their own generic code for that loop.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+/* Weighted distance between two patches: the sum of gw[k] * d( s1[k], s2[k] )
+ * over the columns xL .. xR of 'rows' rows, d being the squared or absolute
+ * difference. The sum of the gw taken is added to *gweights. s1 and s2 advance
+ * by pitch bytes per row, gw by gwpitch elements. */
+typedef double (*nlPatchDistance)( const void *s1, const void *s2, int pitch, const double *gw, int gwpitch,
+                                   int xL, int xR, int rows, double *gweights );
+
+/* The distances as above from the patch of s2 to 'count' patches of s1 at
+ * consecutive columns, s1 being the first, into diffs. Each sum runs over its
+ * patch in row order like the generic loop, whatever the count. */
+typedef void (*nlStripDistance)( const void *s1, const void *s2, int pitch, const double *gw, int gwpitch,
+                                 int xL, int xR, int rows, int count, double *diffs );
+
+struct nlKernels
+{
+    const char     *name;
+    nlPatchDistance distance[2][2];     /* [ssd][bytes per sample - 1] */
+    nlStripDistance strip[2][2];
+};
+
+enum { SIMD_AUTO = -1, SIMD_NONE = 0, SIMD_AVX2, SIMD_AVX512 };
+
+/* The kernels of the given level, or of the highest one below it the CPU
+ * supports. SIMD_AUTO picks the highest level, except that 256-bit kernels
+ * are preferred on CPUs that lower their clock for 512-bit instructions. */
+const nlKernels &nlSelectKernels( int simd );
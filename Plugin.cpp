@@ -53,6 +53,182 @@ static inline void set_option_double
         *opt = default_value;
 }
 
+/* A VapourSynth frame as seen by the filter. The reference is given back
+ * when the filter drops the picture. One is made for every frame fetched, so
+ * dropped ones are kept on a free list and reused rather than going back to
+ * the heap. As many as a filter holds at once are put there when it is made,
+ * so no frame allocates one. */
+class vsPicture : public nlPicture
+{
+private:
+    static std::mutex pool_mtx;
+    static void      *pool;
+    const VSFrameRef *pf;
+    const VSAPI      *vsapi;
+public:
+    vsPicture( const VSFrameRef *_pf, VSFrameRef *writable, const VSAPI *_vsapi ) : pf( _pf ), vsapi( _vsapi )
+    {
+        const VSMap *props = vsapi->getFramePropsRO( pf );
+        int e;
+        cut_prev = vsapi->propGetInt( props, "_SceneChangePrev", 0, &e ) && !e;
+        cut_next = vsapi->propGetInt( props, "_SceneChangeNext", 0, &e ) && !e;
+        for( int i = 0; i < vsapi->getFrameFormat( pf )->numPlanes; ++i )
+        {
+            rptr  [i] = vsapi->getReadPtr    ( pf, i );
+            wptr  [i] = writable ? vsapi->getWritePtr( writable, i ) : nullptr;
+            stride[i] = vsapi->getStride     ( pf, i );
+            width [i] = vsapi->getFrameWidth ( pf, i );
+            height[i] = vsapi->getFrameHeight( pf, i );
+        }
+    }
+    ~vsPicture() { vsapi->freeFrame( pf ); }
+    static void *operator new( size_t size, const std::nothrow_t & ) noexcept
+    {
+        {
+            std::lock_guard< std::mutex > lock( pool_mtx );
+            if( void *p = pool )
+            {
+                pool = *static_cast<void **>(p);
+                return p;
+            }
+        }
+        return ::operator new( size, std::nothrow );
+    }
+    static void *operator new( size_t size )
+    {
+        void *p = operator new( size, std::nothrow );
+        if( p == nullptr )
+            throw std::bad_alloc();
+        return p;
+    }
+    /* Puts 'count' pictures on the free list ahead of use. */
+    static void reserve( int count )
+    {
+        for( int i = 0; i < count; ++i )
+            operator delete( ::operator new( sizeof(vsPicture) ) );
+    }
+    static void operator delete( void *p )
+    {
+        std::lock_guard< std::mutex > lock( pool_mtx );
+        *static_cast<void **>(p) = pool;
+        pool = p;
+    }
+};
+
+std::mutex vsPicture::pool_mtx;
+void      *vsPicture::pool = nullptr;
+
+struct TNLMeansData
+{
+    VSVideoInfo vi;
+    VSNodeRef  *node;
+    VSNodeRef  *mask;
+    TNLMeans   *core;
+    bool        temporal;
+    bool        hauto;
+    bool        max_memory;
+    bool        stats;
+    /* In the recursive mode, the frames skipped before a request, up to
+     * 'linear' of them, are produced along with it, so the recursion follows
+     * the order of the frames rather than that of the requests. The API v3
+     * has no way to hand them to the cache, so the last outputs are kept in
+     * a ring of linear + 1 entries and returned when they are requested.
+     * 'next' is the frame after the last one claimed. */
+    int                               linear;
+    std::atomic< int >                next;
+    std::vector< const VSFrameRef * > produced;
+    std::vector< int >                produced_n;
+    /* With az, the frame the next request will need is fetched ahead by a
+     * thread of the filter's own: getFrameAsync must not be called within
+     * getframe, and a frame requested there would hold back the current one
+     * until it is ready. 'ahead' is the frame to fetch next, or -1, and
+     * 'fetching' counts the fetches whose callback has not run yet. */
+    const VSAPI            *vsapi;
+    std::thread             prefetcher;
+    std::mutex              ahead_mtx;
+    std::condition_variable ahead_cv;
+    int                     ahead;
+    int                     fetching;
+    bool                    stop;
+};
+
+static void VS_CC prefetchDone
+(
+    void             *user_data,
+    const VSFrameRef *f,
+    int               n,
+    VSNodeRef        *,
+    const char       *
+)
+{
+    TNLMeansData *d = static_cast<TNLMeansData *>(user_data);
+    if( f )
+    {
+        nlPicture *pic = new ( std::nothrow ) vsPicture( f, nullptr, d->vsapi );
+        if( pic )
+        {
+            d->core->PutFrame( n, pic );
+            pic->release();
+        }
+        else
+            d->vsapi->freeFrame( f );
+    }
+    std::lock_guard< std::mutex > lock( d->ahead_mtx );
+    --d->fetching;
+    d->ahead_cv.notify_all();
+}
+
+static void prefetchTNLMeans( TNLMeansData *d )
+{
+    std::unique_lock< std::mutex > lock( d->ahead_mtx );
+    for( ; ; )
+    {
+        d->ahead_cv.wait( lock, [d]() { return d->stop || d->ahead >= 0; } );
+        if( d->stop )
+            break;
+        const int n = d->ahead;
+        d->ahead = -1;
+        ++d->fetching;
+        lock.unlock();
+        d->vsapi->getFrameAsync( n, d->node, prefetchDone, d );
+        lock.lock();
+    }
+    /* The clip and the filter must outlive the fetches still running. */
+    d->ahead_cv.wait( lock, [d]() { return d->fetching == 0; } );
+}
+
+/* Hands the frames of the input and mask clips to the filter within one
+ * call of getFrameTNLMeans. */
+class vsProvider : public nlProvider
+{
+private:
+    TNLMeansData   *d;
+    VSFrameContext *frame_ctx;
+    const VSAPI    *vsapi;
+public:
+    vsProvider( TNLMeansData *_d, VSFrameContext *_frame_ctx, const VSAPI *_vsapi ) : d( _d ), frame_ctx( _frame_ctx ), vsapi( _vsapi ) {}
+    const nlPicture *fetch( int n, bool mask )
+    {
+        const VSFrameRef *pf = vsapi->getFrameFilter( n, mask ? d->mask : d->node, frame_ctx );
+        if( pf == nullptr )
+            return nullptr;
+        nlPicture *pic = new ( std::nothrow ) vsPicture( pf, nullptr, vsapi );
+        if( pic == nullptr )
+            vsapi->freeFrame( pf );
+        return pic;
+    }
+    void request( int n, bool mask )
+    {
+        vsapi->requestFrameFilter( n, mask ? d->mask : d->node, frame_ctx );
+    }
+    void prefetch( int n )
+    {
+        std::lock_guard< std::mutex > lock( d->ahead_mtx );
+        d->ahead = n;
+        d->ahead_cv.notify_one();
+    }
+};
+
 static void VS_CC initTNLMeans
 (
     VSMap       *in,
@@ -63,10 +239,79 @@ static void VS_CC initTNLMeans
     const VSAPI *vsapi
 )
 {
-    TNLMeans *d = static_cast<TNLMeans *>(*instance_data);
+    TNLMeansData *d = static_cast<TNLMeansData *>(*instance_data);
     vsapi->setVideoInfo( &d->vi, 1, node );
 }
 
+static VSFrameRef *renderTNLMeans
+(
+    int             n,
+    TNLMeansData   *d,
+    vsProvider     *provider,
+    VSFrameContext *frame_ctx,
+    VSCore         *core,
+    const VSAPI    *vsapi
+)
+{
+    const VSFrameRef *src = vsapi->getFrameFilter( n, d->node, frame_ctx );
+    if( src == nullptr )
+    {
+        vsapi->setFilterError( "TNLMeans:  getFrameFilter failure (src)!", frame_ctx );
+        return nullptr;
+    }
+    std::unique_ptr< VSFrameRef, decltype( vsapi->freeFrame ) > unique_dst
+    (
+        vsapi->newVideoFrame( d->vi.format, d->vi.width, d->vi.height, src, core ),
+        vsapi->freeFrame
+    );
+    vsapi->freeFrame( src );
+    VSFrameRef *dst = unique_dst.get();
+    if( dst == nullptr )
+    {
+        vsapi->setFilterError( "TNLMeans:  newVideoFrame failure (dst)!", frame_ctx );
+        return nullptr;
+    }
+
+    nlReport report;
+    nlPictureRef picture( new vsPicture( vsapi->cloneFrameRef( dst ), dst, vsapi ) );
+    d->core->GetFrame( n, picture.get(), provider, &report );
+    picture.reset();
+
+    VSMap *props = vsapi->getFramePropsRW( dst );
+    if( d->hauto )
+    {
+        vsapi->propDeleteKey( props, "TNLM_Sigma" );
+        vsapi->propDeleteKey( props, "TNLM_H" );
+        for( int plane = 0; plane < d->vi.format->numPlanes; ++plane )
+        {
+            vsapi->propSetFloat( props, "TNLM_Sigma", report.sigma[plane], paAppend );
+            vsapi->propSetFloat( props, "TNLM_H",     report.h    [plane], paAppend );
+        }
+    }
+    if( d->max_memory )
+    {
+        vsapi->propSetInt( props, "TNLM_Slots",     report.slots,              paReplace );
+        vsapi->propSetInt( props, "TNLM_Footprint", int64_t(report.footprint), paReplace );
+    }
+    if( d->stats )
+    {
+        vsapi->propSetInt ( props, "TNLM_TimeUs",      report.time_us,     paReplace );
+        vsapi->propSetInt ( props, "TNLM_Comparisons", report.comparisons, paReplace );
+        vsapi->propSetInt ( props, "TNLM_Pruned",      report.pruned,      paReplace );
+        vsapi->propSetInt ( props, "TNLM_CacheHits",   report.cache_hits,  paReplace );
+        vsapi->propSetInt ( props, "TNLM_SlotWaitUs",  report.wait_us,     paReplace );
+        vsapi->propSetData( props, "TNLM_Engine",      report.engine, -1,  paReplace );
+        vsapi->propSetData( props, "TNLM_SIMD",        report.simd,   -1,  paReplace );
+        if( d->temporal )
+        {
+            /* Totals since the filter was created. */
+            vsapi->propSetInt( props, "TNLM_SourceHits",   report.source_hits,   paReplace );
+            vsapi->propSetInt( props, "TNLM_SourceMisses", report.source_misses, paReplace );
+        }
+    }
+    return unique_dst.release();
+}
+
 static const VSFrameRef * VS_CC getFrameTNLMeans
 (
     int             n,
@@ -78,14 +323,48 @@ static const VSFrameRef * VS_CC getFrameTNLMeans
     const VSAPI    *vsapi
 )
 {
-    TNLMeans *d = static_cast<TNLMeans *>(*instance_data);
+    TNLMeansData *d = static_cast<TNLMeansData *>(*instance_data);
+    vsProvider provider( d, frame_ctx, vsapi );
 
     try
     {
         if( activation_reason == arInitial )
-            d->RequestFrame( n, frame_ctx, core, vsapi );
+        {
+            /* The first frame this request produces is kept in frame_data. */
+            int first = n;
+            if( d->linear > 0 )
+            {
+                int next = d->next.load();
+                while( next <= n && !d->next.compare_exchange_weak( next, n + 1 ) );
+                if( next < n && n - next <= d->linear )
+                    first = next;
+            }
+            *frame_data = reinterpret_cast<void *>(static_cast<intptr_t>(first));
+            for( int i = first; i <= n; ++i )
+                d->core->RequestFrame( i, &provider );
+        }
         else if( activation_reason == arAllFramesReady )
-            return d->GetFrame( n, frame_ctx, core, vsapi );
+        {
+            if( d->linear == 0 )
+                return renderTNLMeans( n, d, &provider, frame_ctx, core, vsapi );
+            /* Frames produced by an earlier request are taken from the ring. The
+             * filter is serial in this mode, so nothing else touches it. */
+            const int first = static_cast<int>(reinterpret_cast<intptr_t>(*frame_data));
+            const int slots = d->linear + 1;
+            for( int i = first; i <= n; ++i )
+            {
+                if( d->produced_n[i % slots] == i )
+                    continue;
+                VSFrameRef *f = renderTNLMeans( i, d, &provider, frame_ctx, core, vsapi );
+                if( f == nullptr )
+                    return nullptr;
+                if( d->produced[i % slots] )
+                    vsapi->freeFrame( d->produced[i % slots] );
+                d->produced  [i % slots] = f;
+                d->produced_n[i % slots] = i;
+            }
+            return vsapi->cloneFrameRef( d->produced[n % slots] );
+        }
     }
     catch( std::bad_alloc &e )
     {
@@ -93,6 +372,13 @@ static const VSFrameRef * VS_CC getFrameTNLMeans
         errMessage += e.what();
         vsapi->setFilterError( errMessage.c_str(), frame_ctx );
     }
+    catch( TNLMeans::bad_frame &e )
+    {
+        std::string errMessage = "TNLMeans:  ";
+        errMessage += e.what();
+        errMessage += "!";
+        vsapi->setFilterError( errMessage.c_str(), frame_ctx );
+    }
 
     return nullptr;
 }
@@ -104,8 +390,23 @@ static void VS_CC closeTNLMeans
     const VSAPI *vsapi
 )
 {
-    TNLMeans *d = static_cast<TNLMeans *>(instance_data);
+    TNLMeansData *d = static_cast<TNLMeansData *>(instance_data);
+    if( d->prefetcher.joinable() )
+    {
+        {
+            std::lock_guard< std::mutex > lock( d->ahead_mtx );
+            d->stop = true;
+            d->ahead_cv.notify_all();
+        }
+        d->prefetcher.join();
+    }
+    for( const VSFrameRef *f : d->produced )
+        if( f )
+            vsapi->freeFrame( f );
+    delete d->core;
     vsapi->freeNode( d->node );
+    if( d->mask )
+        vsapi->freeNode( d->mask );
     delete d;
 }
 
@@ -127,7 +428,18 @@ static void VS_CC createTNLMeans
     int     by;
     double  a;
     double  h;
+    double  hauto;
     int     ssd;
+    int     me;
+    int     meblock;
+    int     recursive;
+    int     sequential;
+    int     flat;
+    int     hugepages;
+    int     numa;
+    int     max_memory;
+    int     simd;
+    int     stats;
     set_option_int   ( &ax,    4, "ax",  in, vsapi );
     set_option_int   ( &ay,    4, "ay",  in, vsapi );
     set_option_int   ( &az,    0, "az",  in, vsapi );
@@ -137,13 +449,72 @@ static void VS_CC createTNLMeans
     set_option_int   ( &by,    1, "by",  in, vsapi );
     set_option_double( &a,   1.0, "a",   in, vsapi );
     set_option_double( &h,   0.5, "h",   in, vsapi );
+    set_option_double( &hauto, 0.0, "hauto", in, vsapi );
     set_option_int   ( &ssd,   1, "ssd", in, vsapi );
+    set_option_int   ( &me,      0, "me",      in, vsapi );
+    set_option_int   ( &meblock, 16, "meblock", in, vsapi );
+    set_option_int   ( &recursive,  0, "recursive",  in, vsapi );
+    set_option_int   ( &sequential, 0, "sequential", in, vsapi );
+    set_option_int   ( &flat,       0, "flat",       in, vsapi );
+    set_option_int   ( &hugepages, 0, "hugepages", in, vsapi );
+    set_option_int   ( &numa,      1, "numa",      in, vsapi );
+    set_option_int   ( &max_memory, 0, "max_memory", in, vsapi );
+    set_option_int   ( &simd,      -1, "simd",       in, vsapi );
+    set_option_int   ( &stats,      0, "stats",      in, vsapi );
 
+    TNLMeansData *d = nullptr;
     try
     {
-        TNLMeans *d = new TNLMeans( ax, ay, az, sx, sy, bx, by, a, h, ssd, in, out, core, vsapi );
-        if( d == nullptr )
-            throw std::bad_alloc();
+        d = new TNLMeansData();
+        d->node = vsapi->propGetNode( in, "clip", 0, 0 );
+        d->vi   = *vsapi->getVideoInfo( d->node );
+        int e;
+        d->mask = vsapi->propGetNode( in, "mask", 0, &e );
+        if( e ) d->mask = nullptr;
+        d->temporal   = az > 0;
+        d->hauto      = hauto > 0.0;
+        d->max_memory = max_memory != 0;
+        d->stats      = stats != 0;
+
+        const VSFormat *format = d->vi.format;
+        if( format == nullptr || d->vi.width == 0 || d->vi.height == 0 )
+            throw TNLMeans::bad_param{ "only constant format and dimensions are supported" };
+        if( format->colorFamily == cmCompat )
+            throw TNLMeans::bad_param{ "only planar formats are supported" };
+        if( format->sampleType != stInteger )
+            throw TNLMeans::bad_param{ "sample type must be integer" };
+        if( d->mask )
+        {
+            const VSVideoInfo *mvi = vsapi->getVideoInfo( d->mask );
+            if( mvi->format != d->vi.format || mvi->width != d->vi.width || mvi->height != d->vi.height )
+                throw TNLMeans::bad_param{ "mask must have the same format and dimensions as clip" };
+        }
+
+        nlVideoInfo nvi;
+        nvi.format.numPlanes      = format->numPlanes;
+        nvi.format.bitsPerSample  = format->bitsPerSample;
+        nvi.format.bytesPerSample = format->bytesPerSample;
+        nvi.format.subSamplingW   = format->subSamplingW;
+        nvi.format.subSamplingH   = format->subSamplingH;
+        nvi.width     = d->vi.width;
+        nvi.height    = d->vi.height;
+        nvi.numFrames = d->vi.numFrames;
+        d->core = new TNLMeans( ax, ay, az, sx, sy, bx, by, a, h, hauto, ssd, me, meblock, recursive, sequential, flat, hugepages, numa, max_memory, simd,
+                                nvi, vsapi->getCoreInfo( core )->numThreads, d->mask != nullptr );
+        vsPicture::reserve( d->core->MaxPictures() );
+
+        /* The API v3 calls a serial filter once at a time, but not in order. */
+        d->linear = recursive ? std::max( vsapi->getCoreInfo( core )->numThreads, 1 ) : 0;
+        d->next   = 0;
+        d->produced  .assign( d->linear + 1, nullptr );
+        d->produced_n.assign( d->linear + 1, -1 );
+
+        d->vsapi    = vsapi;
+        d->ahead    = -1;
+        d->fetching = 0;
+        d->stop     = false;
+        if( az > 0 )
+            d->prefetcher = std::thread( prefetchTNLMeans, d );
 
         vsapi->createFilter
         (
@@ -152,13 +523,13 @@ static void VS_CC createTNLMeans
             initTNLMeans,
             getFrameTNLMeans,
             closeTNLMeans,
-            fmParallel, 0, d, core
+            recursive ? fmSerial : fmParallel, 0, d, core
         );
+        return;
     }
     catch( std::bad_alloc & )
     {
         vsapi->setError( out, "TNLMeans:  create failure (TNLMeans)!" );
-        return;
     }
     catch( TNLMeans::bad_param &e )
     {
@@ -166,7 +537,6 @@ static void VS_CC createTNLMeans
         errMessage += e.what();
         errMessage += "!";
         vsapi->setError( out, errMessage.c_str() );
-        return;
     }
     catch( TNLMeans::bad_alloc &e )
     {
@@ -174,11 +544,15 @@ static void VS_CC createTNLMeans
         errMessage += e.what();
         errMessage += ")!";
         vsapi->setError( out, errMessage.c_str() );
-        return;
     }
     catch( ... )
     {
-        return;
+    }
+    if( d )
+    {
+        vsapi->freeNode( d->node );
+        vsapi->freeNode( d->mask );
+        delete d;
     }
 }
 
@@ -198,7 +572,7 @@ VS_EXTERNAL_API( void ) VapourSynthPluginInit
     register_func
     (
         "TNLMeans",
-        "clip:clip;ax:int:opt;ay:int:opt;az:int:opt;sx:int:opt;sy:int:opt;bx:int:opt;by:int:opt;a:float:opt;h:float:opt;ssd:int:opt;",
+        "clip:clip;ax:int:opt;ay:int:opt;az:int:opt;sx:int:opt;sy:int:opt;bx:int:opt;by:int:opt;a:float:opt;h:float:opt;hauto:float:opt;ssd:int:opt;me:int:opt;meblock:int:opt;recursive:int:opt;sequential:int:opt;mask:clip:opt;flat:int:opt;hugepages:int:opt;numa:int:opt;max_memory:int:opt;simd:int:opt;stats:int:opt;",
         createTNLMeans, nullptr, plugin
     );
 }
@@ -0,0 +1,553 @@
+/*****************************************************************************
+ * Plugin4.cpp
+ *****************************************************************************
+ * VapourSynth API v4 interface of the TNLMeans filter. Plugin.cpp is the
+ * same for API v3; the build selects one of them (meson option 'api').
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *****************************************************************************/
+
+#include "config.h"
+#include "VapourSynth4.h"
+#include "VSHelper4.h"
+#include "TNLMeans.h"
+
+static inline void set_option_int
+(
+    int         *opt,
+    int          default_value,
+    const char  *arg,
+    const VSMap *in,
+    const VSAPI *vsapi
+)
+{
+    int e;
+    *opt = vsh::int64ToIntS( vsapi->mapGetInt( in, arg, 0, &e ) );
+    if( e )
+        *opt = default_value;
+}
+
+static inline void set_option_double
+(
+    double      *opt,
+    double       default_value,
+    const char  *arg,
+    const VSMap *in,
+    const VSAPI *vsapi
+)
+{
+    int e;
+    *opt = vsapi->mapGetFloat( in, arg, 0, &e );
+    if( e )
+        *opt = default_value;
+}
+
+/* A VapourSynth frame as seen by the filter. The reference is given back
+ * when the filter drops the picture. One is made for every frame fetched, so
+ * dropped ones are kept on a free list and reused rather than going back to
+ * the heap. As many as a filter holds at once are put there when it is made,
+ * so no frame allocates one. */
+class vsPicture : public nlPicture
+{
+private:
+    static std::mutex pool_mtx;
+    static void      *pool;
+    const VSFrame *pf;
+    const VSAPI   *vsapi;
+public:
+    vsPicture( const VSFrame *_pf, VSFrame *writable, const VSAPI *_vsapi ) : pf( _pf ), vsapi( _vsapi )
+    {
+        const VSMap *props = vsapi->getFramePropertiesRO( pf );
+        int e;
+        cut_prev = vsapi->mapGetInt( props, "_SceneChangePrev", 0, &e ) && !e;
+        cut_next = vsapi->mapGetInt( props, "_SceneChangeNext", 0, &e ) && !e;
+        for( int i = 0; i < vsapi->getVideoFrameFormat( pf )->numPlanes; ++i )
+        {
+            rptr  [i] = vsapi->getReadPtr    ( pf, i );
+            wptr  [i] = writable ? vsapi->getWritePtr( writable, i ) : nullptr;
+            stride[i] = static_cast<int>(vsapi->getStride( pf, i ));
+            width [i] = vsapi->getFrameWidth ( pf, i );
+            height[i] = vsapi->getFrameHeight( pf, i );
+        }
+    }
+    ~vsPicture() { vsapi->freeFrame( pf ); }
+    static void *operator new( size_t size, const std::nothrow_t & ) noexcept
+    {
+        {
+            std::lock_guard< std::mutex > lock( pool_mtx );
+            if( void *p = pool )
+            {
+                pool = *static_cast<void **>(p);
+                return p;
+            }
+        }
+        return ::operator new( size, std::nothrow );
+    }
+    static void *operator new( size_t size )
+    {
+        void *p = operator new( size, std::nothrow );
+        if( p == nullptr )
+            throw std::bad_alloc();
+        return p;
+    }
+    /* Puts 'count' pictures on the free list ahead of use. */
+    static void reserve( int count )
+    {
+        for( int i = 0; i < count; ++i )
+            operator delete( ::operator new( sizeof(vsPicture) ) );
+    }
+    static void operator delete( void *p )
+    {
+        std::lock_guard< std::mutex > lock( pool_mtx );
+        *static_cast<void **>(p) = pool;
+        pool = p;
+    }
+};
+
+std::mutex vsPicture::pool_mtx;
+void      *vsPicture::pool = nullptr;
+
+struct TNLMeansData
+{
+    VSVideoInfo vi;
+    VSNode     *node;
+    VSNode     *mask;
+    TNLMeans   *core;
+    bool        temporal;
+    bool        hauto;
+    bool        max_memory;
+    bool        stats;
+    /* For a linear filter, the frames skipped before a request, up to
+     * 'linear' of them, are produced along with it and handed to the cache,
+     * so the frames shared between neighbours and the recursion are not lost
+     * to small jumps. 'next' is the frame after the last one claimed. */
+    int                linear;
+    std::atomic< int > next;
+    /* With az, the frame the next request will need is fetched ahead by a
+     * thread of the filter's own: getFrameAsync must not be called within
+     * getframe, and a frame requested there would hold back the current one
+     * until it is ready. 'ahead' is the frame to fetch next, or -1, and
+     * 'fetching' counts the fetches whose callback has not run yet. */
+    const VSAPI            *vsapi;
+    std::thread             prefetcher;
+    std::mutex              ahead_mtx;
+    std::condition_variable ahead_cv;
+    int                     ahead;
+    int                     fetching;
+    bool                    stop;
+};
+
+static void VS_CC prefetchDone
+(
+    void          *user_data,
+    const VSFrame *f,
+    int            n,
+    VSNode        *,
+    const char    *
+)
+{
+    TNLMeansData *d = static_cast<TNLMeansData *>(user_data);
+    if( f )
+    {
+        nlPicture *pic = new ( std::nothrow ) vsPicture( f, nullptr, d->vsapi );
+        if( pic )
+        {
+            d->core->PutFrame( n, pic );
+            pic->release();
+        }
+        else
+            d->vsapi->freeFrame( f );
+    }
+    std::lock_guard< std::mutex > lock( d->ahead_mtx );
+    --d->fetching;
+    d->ahead_cv.notify_all();
+}
+
+static void prefetchTNLMeans( TNLMeansData *d )
+{
+    std::unique_lock< std::mutex > lock( d->ahead_mtx );
+    for( ; ; )
+    {
+        d->ahead_cv.wait( lock, [d]() { return d->stop || d->ahead >= 0; } );
+        if( d->stop )
+            break;
+        const int n = d->ahead;
+        d->ahead = -1;
+        ++d->fetching;
+        lock.unlock();
+        d->vsapi->getFrameAsync( n, d->node, prefetchDone, d );
+        lock.lock();
+    }
+    /* The clip and the filter must outlive the fetches still running. */
+    d->ahead_cv.wait( lock, [d]() { return d->fetching == 0; } );
+}
+
+/* Hands the frames of the input and mask clips to the filter within one
+ * call of getFrameTNLMeans. */
+class vsProvider : public nlProvider
+{
+private:
+    TNLMeansData   *d;
+    VSFrameContext *frame_ctx;
+    const VSAPI    *vsapi;
+public:
+    vsProvider( TNLMeansData *_d, VSFrameContext *_frame_ctx, const VSAPI *_vsapi ) : d( _d ), frame_ctx( _frame_ctx ), vsapi( _vsapi ) {}
+    const nlPicture *fetch( int n, bool mask )
+    {
+        const VSFrame *pf = vsapi->getFrameFilter( n, mask ? d->mask : d->node, frame_ctx );
+        if( pf == nullptr )
+            return nullptr;
+        nlPicture *pic = new ( std::nothrow ) vsPicture( pf, nullptr, vsapi );
+        if( pic == nullptr )
+            vsapi->freeFrame( pf );
+        return pic;
+    }
+    void request( int n, bool mask )
+    {
+        vsapi->requestFrameFilter( n, mask ? d->mask : d->node, frame_ctx );
+    }
+    void prefetch( int n )
+    {
+        std::lock_guard< std::mutex > lock( d->ahead_mtx );
+        d->ahead = n;
+        d->ahead_cv.notify_one();
+    }
+};
+
+static VSFrame *renderTNLMeans
+(
+    int             n,
+    TNLMeansData   *d,
+    vsProvider     *provider,
+    VSFrameContext *frame_ctx,
+    VSCore         *core,
+    const VSAPI    *vsapi
+)
+{
+    const VSFrame *src = vsapi->getFrameFilter( n, d->node, frame_ctx );
+    if( src == nullptr )
+    {
+        vsapi->setFilterError( "TNLMeans:  getFrameFilter failure (src)!", frame_ctx );
+        return nullptr;
+    }
+    std::unique_ptr< VSFrame, decltype( vsapi->freeFrame ) > unique_dst
+    (
+        vsapi->newVideoFrame( &d->vi.format, d->vi.width, d->vi.height, src, core ),
+        vsapi->freeFrame
+    );
+    vsapi->freeFrame( src );
+    VSFrame *dst = unique_dst.get();
+    if( dst == nullptr )
+    {
+        vsapi->setFilterError( "TNLMeans:  newVideoFrame failure (dst)!", frame_ctx );
+        return nullptr;
+    }
+
+    nlReport report;
+    nlPictureRef picture( new vsPicture( vsapi->addFrameRef( dst ), dst, vsapi ) );
+    d->core->GetFrame( n, picture.get(), provider, &report );
+    picture.reset();
+
+    VSMap *props = vsapi->getFramePropertiesRW( dst );
+    if( d->hauto )
+    {
+        vsapi->mapDeleteKey( props, "TNLM_Sigma" );
+        vsapi->mapDeleteKey( props, "TNLM_H" );
+        for( int plane = 0; plane < d->vi.format.numPlanes; ++plane )
+        {
+            vsapi->mapSetFloat( props, "TNLM_Sigma", report.sigma[plane], maAppend );
+            vsapi->mapSetFloat( props, "TNLM_H",     report.h    [plane], maAppend );
+        }
+    }
+    if( d->max_memory )
+    {
+        vsapi->mapSetInt( props, "TNLM_Slots",     report.slots,              maReplace );
+        vsapi->mapSetInt( props, "TNLM_Footprint", int64_t(report.footprint), maReplace );
+    }
+    if( d->stats )
+    {
+        vsapi->mapSetInt ( props, "TNLM_TimeUs",      report.time_us,     maReplace );
+        vsapi->mapSetInt ( props, "TNLM_Comparisons", report.comparisons, maReplace );
+        vsapi->mapSetInt ( props, "TNLM_Pruned",      report.pruned,      maReplace );
+        vsapi->mapSetInt ( props, "TNLM_CacheHits",   report.cache_hits,  maReplace );
+        vsapi->mapSetInt ( props, "TNLM_SlotWaitUs",  report.wait_us,     maReplace );
+        vsapi->mapSetData( props, "TNLM_Engine",      report.engine, -1,  dtUtf8, maReplace );
+        vsapi->mapSetData( props, "TNLM_SIMD",        report.simd,   -1,  dtUtf8, maReplace );
+        if( d->temporal )
+        {
+            /* Totals since the filter was created. */
+            vsapi->mapSetInt( props, "TNLM_SourceHits",   report.source_hits,   maReplace );
+            vsapi->mapSetInt( props, "TNLM_SourceMisses", report.source_misses, maReplace );
+        }
+    }
+    return unique_dst.release();
+}
+
+static const VSFrame * VS_CC getFrameTNLMeans
+(
+    int             n,
+    int             activation_reason,
+    void           *instance_data,
+    void          **frame_data,
+    VSFrameContext *frame_ctx,
+    VSCore         *core,
+    const VSAPI    *vsapi
+)
+{
+    TNLMeansData *d = static_cast<TNLMeansData *>(instance_data);
+    vsProvider provider( d, frame_ctx, vsapi );
+
+    try
+    {
+        if( activation_reason == arInitial )
+        {
+            /* The first frame this request produces is kept in frame_data. */
+            int first = n;
+            if( d->linear > 0 )
+            {
+                int next = d->next.load();
+                while( next <= n && !d->next.compare_exchange_weak( next, n + 1 ) );
+                if( next < n && n - next <= d->linear )
+                    first = next;
+            }
+            *frame_data = reinterpret_cast<void *>(static_cast<intptr_t>(first));
+            for( int i = first; i <= n; ++i )
+                d->core->RequestFrame( i, &provider );
+        }
+        else if( activation_reason == arAllFramesReady )
+        {
+            const int first = static_cast<int>(reinterpret_cast<intptr_t>(*frame_data));
+            for( int i = first; i < n; ++i )
+            {
+                VSFrame *skipped = renderTNLMeans( i, d, &provider, frame_ctx, core, vsapi );
+                if( skipped == nullptr )
+                    return nullptr;
+                vsapi->cacheFrame( skipped, i, frame_ctx );
+                vsapi->freeFrame( skipped );
+            }
+            return renderTNLMeans( n, d, &provider, frame_ctx, core, vsapi );
+        }
+    }
+    catch( std::bad_alloc &e )
+    {
+        std::string errMessage = "TNLMeans:  ";
+        errMessage += e.what();
+        vsapi->setFilterError( errMessage.c_str(), frame_ctx );
+    }
+    catch( TNLMeans::bad_frame &e )
+    {
+        std::string errMessage = "TNLMeans:  ";
+        errMessage += e.what();
+        errMessage += "!";
+        vsapi->setFilterError( errMessage.c_str(), frame_ctx );
+    }
+
+    return nullptr;
+}
+
+static void VS_CC freeTNLMeans
+(
+    void        *instance_data,
+    VSCore      *core,
+    const VSAPI *vsapi
+)
+{
+    TNLMeansData *d = static_cast<TNLMeansData *>(instance_data);
+    if( d->prefetcher.joinable() )
+    {
+        {
+            std::lock_guard< std::mutex > lock( d->ahead_mtx );
+            d->stop = true;
+            d->ahead_cv.notify_all();
+        }
+        d->prefetcher.join();
+    }
+    delete d->core;
+    vsapi->freeNode( d->node );
+    if( d->mask )
+        vsapi->freeNode( d->mask );
+    delete d;
+}
+
+static void VS_CC createTNLMeans
+(
+    const VSMap *in,
+    VSMap       *out,
+    void        *user_data,
+    VSCore      *core,
+    const VSAPI *vsapi
+)
+{
+    int     ax;
+    int     ay;
+    int     az;
+    int     sx;
+    int     sy;
+    int     bx;
+    int     by;
+    double  a;
+    double  h;
+    double  hauto;
+    int     ssd;
+    int     me;
+    int     meblock;
+    int     recursive;
+    int     sequential;
+    int     flat;
+    int     hugepages;
+    int     numa;
+    int     max_memory;
+    int     simd;
+    int     stats;
+    set_option_int   ( &ax,    4, "ax",  in, vsapi );
+    set_option_int   ( &ay,    4, "ay",  in, vsapi );
+    set_option_int   ( &az,    0, "az",  in, vsapi );
+    set_option_int   ( &sx,    2, "sx",  in, vsapi );
+    set_option_int   ( &sy,    2, "sy",  in, vsapi );
+    set_option_int   ( &bx,    1, "bx",  in, vsapi );
+    set_option_int   ( &by,    1, "by",  in, vsapi );
+    set_option_double( &a,   1.0, "a",   in, vsapi );
+    set_option_double( &h,   0.5, "h",   in, vsapi );
+    set_option_double( &hauto, 0.0, "hauto", in, vsapi );
+    set_option_int   ( &ssd,   1, "ssd", in, vsapi );
+    set_option_int   ( &me,      0, "me",      in, vsapi );
+    set_option_int   ( &meblock, 16, "meblock", in, vsapi );
+    set_option_int   ( &recursive,  0, "recursive",  in, vsapi );
+    set_option_int   ( &sequential, 0, "sequential", in, vsapi );
+    set_option_int   ( &flat,       0, "flat",       in, vsapi );
+    set_option_int   ( &hugepages, 0, "hugepages", in, vsapi );
+    set_option_int   ( &numa,      1, "numa",      in, vsapi );
+    set_option_int   ( &max_memory, 0, "max_memory", in, vsapi );
+    set_option_int   ( &simd,      -1, "simd",       in, vsapi );
+    set_option_int   ( &stats,      0, "stats",      in, vsapi );
+
+    TNLMeansData *d = nullptr;
+    try
+    {
+        d = new TNLMeansData();
+        d->node = vsapi->mapGetNode( in, "clip", 0, 0 );
+        d->vi   = *vsapi->getVideoInfo( d->node );
+        int e;
+        d->mask = vsapi->mapGetNode( in, "mask", 0, &e );
+        if( e ) d->mask = nullptr;
+        d->temporal   = az > 0;
+        d->hauto      = hauto > 0.0;
+        d->max_memory = max_memory != 0;
+        d->stats      = stats != 0;
+        d->linear     = 0;
+        d->next       = 0;
+
+        const VSVideoFormat &format = d->vi.format;
+        if( !vsh::isConstantVideoFormat( &d->vi ) )
+            throw TNLMeans::bad_param{ "only constant format and dimensions are supported" };
+        if( format.sampleType != stInteger )
+            throw TNLMeans::bad_param{ "sample type must be integer" };
+        const VSVideoInfo *mvi = d->mask ? vsapi->getVideoInfo( d->mask ) : nullptr;
+        if( mvi && (!vsh::isSameVideoFormat( &mvi->format, &format ) || mvi->width != d->vi.width || mvi->height != d->vi.height) )
+            throw TNLMeans::bad_param{ "mask must have the same format and dimensions as clip" };
+
+        nlVideoInfo nvi;
+        nvi.format.numPlanes      = format.numPlanes;
+        nvi.format.bitsPerSample  = format.bitsPerSample;
+        nvi.format.bytesPerSample = format.bytesPerSample;
+        nvi.format.subSamplingW   = format.subSamplingW;
+        nvi.format.subSamplingH   = format.subSamplingH;
+        nvi.width     = d->vi.width;
+        nvi.height    = d->vi.height;
+        nvi.numFrames = d->vi.numFrames;
+        VSCoreInfo info;
+        vsapi->getCoreInfo( core, &info );
+        d->core = new TNLMeans( ax, ay, az, sx, sy, bx, by, a, h, hauto, ssd, me, meblock, recursive, sequential, flat, hugepages, numa, max_memory, simd,
+                                nvi, info.numThreads, d->mask != nullptr );
+        vsPicture::reserve( d->core->MaxPictures() );
+        d->vsapi    = vsapi;
+        d->ahead    = -1;
+        d->fetching = 0;
+        d->stop     = false;
+
+        /* Without az every output frame needs only the same frame of the clip
+         * (and mask, unless that is shorter). */
+        VSFilterDependency deps[2];
+        int num_deps = 0;
+        deps[num_deps++] = { d->node, az > 0 ? rpGeneral : rpStrictSpatial };
+        if( d->mask )
+            deps[num_deps++] = { d->mask, mvi->numFrames >= d->vi.numFrames ? rpStrictSpatial : rpGeneral };
+
+        VSNode *node = vsapi->createVideoFilter2
+        (
+            "TNLMeans",
+            &d->vi,
+            getFrameTNLMeans,
+            freeTNLMeans,
+            recursive ? fmFrameState : fmParallel,
+            deps, num_deps, d, core
+        );
+        /* The recursion is only correct when frames are produced in order,
+         * whatever az is; the sequential temporal mode is just cheapest so. */
+        if( recursive || (az > 0 && sequential) )
+            d->linear = vsapi->setLinearFilter( node );
+        if( az > 0 )
+            d->prefetcher = std::thread( prefetchTNLMeans, d );
+        vsapi->mapConsumeNode( out, "clip", node, maReplace );
+        return;
+    }
+    catch( std::bad_alloc & )
+    {
+        vsapi->mapSetError( out, "TNLMeans:  create failure (TNLMeans)!" );
+    }
+    catch( TNLMeans::bad_param &e )
+    {
+        std::string errMessage = "TNLMeans:  ";
+        errMessage += e.what();
+        errMessage += "!";
+        vsapi->mapSetError( out, errMessage.c_str() );
+    }
+    catch( TNLMeans::bad_alloc &e )
+    {
+        std::string errMessage = "TNLMeans:  allocation failure (";
+        errMessage += e.what();
+        errMessage += ")!";
+        vsapi->mapSetError( out, errMessage.c_str() );
+    }
+    catch( ... )
+    {
+    }
+    if( d )
+    {
+        delete d->core;
+        vsapi->freeNode( d->node );
+        vsapi->freeNode( d->mask );
+        delete d;
+    }
+}
+
+VS_EXTERNAL_API( void ) VapourSynthPluginInit2
+(
+    VSPlugin           *plugin,
+    const VSPLUGINAPI  *vspapi
+)
+{
+    vspapi->configPlugin
+    (
+        "systems.innocent.tnlm", "tnlm",
+        "TNLMeans rev" VSTNLMEANS_REV "-" VSTNLMEANS_GIT_HASH,
+        VS_MAKE_VERSION( 1, 0 ), VAPOURSYNTH_API_VERSION, 0, plugin
+    );
+    vspapi->registerFunction
+    (
+        "TNLMeans",
+        "clip:vnode;ax:int:opt;ay:int:opt;az:int:opt;sx:int:opt;sy:int:opt;bx:int:opt;by:int:opt;a:float:opt;h:float:opt;hauto:float:opt;ssd:int:opt;me:int:opt;meblock:int:opt;recursive:int:opt;sequential:int:opt;mask:vnode:opt;flat:int:opt;hugepages:int:opt;numa:int:opt;max_memory:int:opt;simd:int:opt;stats:int:opt;",
+        "clip:vnode;",
+        createTNLMeans, nullptr, plugin
+    );
+}
@@ -25,7 +25,6 @@
 
 #include <cstdlib>
 
-#include "VapourSynth.h"
 #include "TNLMeans.h"
 
 TNLMeans::TNLMeans
@@ -33,19 +32,23 @@ TNLMeans::TNLMeans
     int _Ax, int _Ay, int _Az,
     int _Sx, int _Sy,
     int _Bx, int _By,
-    double _a, double _h, bool _ssd,
-    const VSMap *in,
-    VSMap       *out,
-    VSCore      *core,
-    const VSAPI *vsapi
+    double _a, double _h, double _hauto, bool _ssd,
+    int _me_range, int _me_block, bool _recursive, bool _sequential, int _flat,
+    bool _hugepages, bool _numa, int _max_memory, int _simd,
+    const nlVideoInfo &_vi, int _threads, bool _masked
 ) : Ax( _Ax ), Ay( _Ay ), Az( _Az ),
     Sx( _Sx ), Sy( _Sy ),
     Bx( _Bx ), By( _By ),
-    a( _a ), h( _h ), use_ssd( _ssd )
+    a( _a ), h( _h ), hauto( _hauto ), masked( _masked ), me_range( _me_range ), me_block( _me_block ), flat( _flat ),
+    use_ssd( _ssd ), sequential( _sequential ),
+    hugepages( _hugepages ), numNodes( _numa ? AlignedMemory::numa_nodes() : 1 ), numThreads( std::max( _threads, 1 ) ),
+    max_memory( static_cast<size_t>(std::max( _max_memory, 0 )) << 20 ),
+    vi( _vi )
 {
-    node =  vsapi->propGetNode( in, "clip", 0, 0 );
-    vi   = *vsapi->getVideoInfo( node );
-    numThreads = vsapi->getCoreInfo( core )->numThreads;
+    if( vi.format.numPlanes < 1 || vi.format.numPlanes > 3 )
+        throw bad_param{ "clip must have 1 to 3 planes" };
+    if( vi.format.bitsPerSample < 1 || vi.format.bitsPerSample > 16 )
+        throw bad_param{ "bitsPerSample must be 1 to 16" };
     if( h <= 0.0 ) throw bad_param{ "h must be greater than 0" };
     if( a <= 0.0 ) throw bad_param{ "a must be greater than 0" };
     if( Ax < 0 )   throw bad_param{ "ax must be greater than or equal to 0" };
@@ -57,6 +60,19 @@ TNLMeans::TNLMeans
     if( Sy < 0 )   throw bad_param{ "sy must be greater than or equal to 0" };
     if( Sx < Bx )  throw bad_param{ "sx must be greater than or equal to bx" };
     if( Sy < By )  throw bad_param{ "sy must be greater than or equal to by" };
+    if( _recursive && (Bx || By) ) throw bad_param{ "recursive requires bx = 0 and by = 0" };
+    if( hauto < 0.0 ) throw bad_param{ "hauto must be greater than or equal to 0" };
+    if( flat < 0 ) throw bad_param{ "flat must be greater than or equal to 0" };
+    if( me_range < 0 ) throw bad_param{ "me must be greater than or equal to 0" };
+    if( me_block < 1 ) throw bad_param{ "meblock must be greater than 0" };
+    if( _max_memory < 0 ) throw bad_param{ "max_memory must be greater than or equal to 0" };
+    if( _simd < SIMD_AUTO || _simd > SIMD_AVX512 ) throw bad_param{ "simd must be -1, 0, 1 or 2" };
+    kernels = nlSelectKernels( _simd );
+    /* Patch rows of three samples or fewer are done faster by the generic code,
+     * but the strips still fill their lanes with candidates. */
+    if( Sx < 2 )
+        for( auto &d : kernels.distance )
+            d[0] = d[1] = nullptr;
     h2in = -1.0 / (h * h);
     hin = -1.0 / h;
     Sxd = Sx * 2 + 1;
@@ -70,169 +86,518 @@ TNLMeans::TNLMeans
     Axa = Axd * Ayd;
     Azdm1 = Az * 2;
     a2 = a * a;
+    if( Az == 0 ) me_range = 0;
+    mvw = (vi.width  + me_block - 1) / me_block;
+    mvh = (vi.height + me_block - 1) / me_block;
+    skipping = masked || flat;
+    skip_size = 0;
+    for( int i = 0; i < 3; ++i )
+    {
+        skip_offset[i] = skip_size;
+        if( i < vi.format.numPlanes )
+            skip_size += (vi.width >> (i ? vi.format.subSamplingW : 0)) * (vi.height >> (i ? vi.format.subSamplingH : 0));
+    }
 
     std::unique_ptr< nlThread [] > threads( new ( std::nothrow ) nlThread[numThreads] );
     if( threads == nullptr ) throw bad_alloc{ "threads" };
+    /* The slots are spread over the NUMA nodes, and a thread prefers those of its own. */
+    for( int i = 0; i < numThreads; ++i )
+        threads[i].node = i % numNodes;
+
+    /* Enough entries for every thread to hold its own frame and the later half
+     * of its temporal neighbourhood, plus the frames still waiting behind it.
+     * Motion compensated pairs are not symmetric, and with hauto the weights
+     * depend on the frame filtered, so neither is shared. Each NUMA node has a
+     * window of its own for the slots placed on it, so the accumulators are
+     * never added across nodes. */
+    if( Az && !(Bx || By) && me_range == 0 && hauto == 0.0 )
+        for( int k = 0; k < numNodes; ++k )
+        {
+            try { windows.emplace_back( new nlWindow{ WindowSize( k ), Az * 2 + 1, vi } ); }
+            catch( ... ) { throw bad_alloc{ "nlWindow" }; }
+        }
+
+    std::unique_ptr< nlFrame > recent;
+    if( _recursive )
+    {
+        try { recent.reset( new nlFrame( false, vi ) ); }
+        catch( ... ) { throw bad_alloc{ "nlFrame" }; }
+    }
+    this->recent = recent.get();
+
+    /* The window of every thread, plus the frames ahead of them. */
+    std::unique_ptr< nlSource > source;
+    if( Az )
+    {
+        try { source.reset( new nlSource{ Az * 2 + 2 + numThreads, vi } ); }
+        catch( ... ) { throw bad_alloc{ "nlSource" }; }
+    }
+    this->source = source.get();
+    last_request = -2;
+    linear_run   = 0;
 
     for( int i = 0; i < numThreads; ++i )
+        InitThread( &threads.get()[i] );
+
+    /* Measure the layout of all buffers first, then place them in one region.
+     * With a memory budget, drop thread slots until the footprint fits. The
+     * remaining slots are shared by all VapourSynth threads. */
+    footprint = EstimateFootprint( threads.get() );
+    while( max_memory && footprint > max_memory && numThreads > 1 )
     {
-        nlThread *t = &threads.get()[i];
-        if( Az )
+        --numThreads;
+        footprint = EstimateFootprint( threads.get() );
+    }
+    if( max_memory && footprint > max_memory )
+        throw bad_param{ "max_memory must be at least " + std::to_string( (footprint + (1 << 20) - 1) >> 20 ) + " MiB for these parameters" };
+    try { arena.commit( hugepages ); }
+    catch( ... ) { throw bad_alloc{ "arena" }; }
+    PlaceBuffers( threads.get() );
+
+    FillWeights( gw );
+    this->threads = threads.release();
+    extra    = nullptr;
+    numSlots = numThreads;
+    waiting  = 0;
+    id       = ++instances;
+    recent.release();
+    source.release();
+}
+
+TNLMeans::~TNLMeans()
+{
+    delete [] threads;
+    for( nlThread *t = extra; t; )
+    {
+        nlThread *next = t->next;
+        delete t;
+        t = next;
+    }
+    delete recent;
+    delete source;
+}
+
+std::atomic< uint64_t > TNLMeans::instances{ 0 };
+
+void TNLMeans::InitThread( nlThread *t )
+{
+    if( Az )
+    {
+        try { t->fc = new nlCache{ Az * 2 + 1, vi }; }
+        catch( nlFrame::bad_alloc & ) { throw bad_alloc{ "nlFrame" }; }
+        catch( ... )                  { throw bad_alloc{ "nlCache" }; }
+        if( !(Bx || By) )
         {
-            try { t->fc = new nlCache{ Az * 2 + 1, (Bx > 0 || By > 0), vi, vsapi }; }
-            catch( nlFrame::bad_alloc & ) { throw bad_alloc{ "nlFrame" }; }
-            catch( ... )                  { throw bad_alloc{ "nlCache" }; }
+            try
+            {
+                t->own   = new nlFrame( true, vi );
+                t->other = new nlFrame( true, vi );
+            }
+            catch( ... ) { throw bad_alloc{ "nlFrame" }; }
         }
+    }
 
-        if( Bx || By )
+    if( !(Bx || By) && Az == 0 )
+        t->ds = new SDATA();
+}
+
+void TNLMeans::FillWeights( double *gw ) const
+{
+    int w = 0, m, n;
+    for( int j = -Sy; j <= Sy; ++j )
+    {
+        if( j < 0 )
+            m = std::min( j + By, 0 );
+        else
+            m = std::max( j - By, 0 );
+        for( int k = -Sx; k <= Sx; ++k )
         {
-            try { t->sumsb    = new AlignedArrayObject< double, 16 >{ Bxa }; }
-            catch( ... ) { throw bad_alloc{ "sumsb" }; }
-            try { t->weightsb = new AlignedArrayObject< double, 16 >{ Bxa }; }
-            catch( ... ) { throw bad_alloc{ "weightsb" }; }
+            if( k < 0 )
+                n = std::min( k + Bx, 0 );
+            else
+                n = std::max( k - Bx, 0 );
+            gw[w++] = std::exp( -((m * m + n * n) / (2 * a2)) );
         }
-        else if( Az == 0 )
+    }
+}
+
+size_t TNLMeans::FrameSize()
+{
+    size_t frame_size = 0;
+    for( int i = 0; i < vi.format.numPlanes; ++i )
+        frame_size += static_cast<size_t>(vi.width  >> (i ? vi.format.subSamplingW : 0))
+                    *                    (vi.height >> (i ? vi.format.subSamplingH : 0))
+                    * vi.format.bytesPerSample;
+    return frame_size;
+}
+
+size_t TNLMeans::EstimateFootprint( nlThread *threads )
+{
+    arena.rewind();
+    PlaceBuffers( threads );
+    /* Each thread also holds references to the source frames it works on. */
+    return arena.size() + FrameSize() * ((Az * 2 + 1) * numThreads + (source ? source->size : 0));
+}
+
+int TNLMeans::WindowSize( int node )
+{
+    const int slots = (numThreads + numNodes - 1 - node) / numNodes;
+    return slots * (Az + 1) + Az;
+}
+
+void TNLMeans::PlaceBuffers( nlThread *threads )
+{
+    /* The patch weights are read by every thread but written only here, so
+     * there is one table for the filter, kept apart from the per-thread
+     * scratch which is first touched by the worker using it. */
+    gw = arena.take< double >( Sxa );
+    for( int k = 0; k < static_cast<int>(windows.size()); ++k )
+    {
+        arena.align( hugepages ? AlignedMemory::huge_page_size : AlignedMemory::page_size );
+        const size_t from = arena.offset();
+        windows[k]->size = WindowSize( k );
+        windows[k]->place( arena, vi );
+        if( numNodes > 1 )
+            arena.bind( from, k );
+    }
+    if( source )
+    {
+        source->size = Az * 2 + 2 + numThreads;
+        source->place( arena );
+    }
+    for( int i = 0; i < numThreads; ++i )
+        PlaceThread( &threads[i], arena );
+}
+
+void TNLMeans::PlaceThread( nlThread *t, AlignedArena &arena )
+{
+    arena.align( hugepages ? AlignedMemory::huge_page_size : AlignedMemory::page_size );
+    const size_t from = arena.offset();
+    if( t->fc )
+        t->fc->place( arena );
+    if( t->own )
+    {
+        t->own  ->place( arena, 0, vi );
+        t->other->place( arena, 0, vi );
+    }
+    if( me_range )
+        t->mvs = arena.take< int >( (Az * 2 + 1) * mvw * mvh * 2 );
+    if( skipping )
+        t->skip = arena.take< uint8_t >( skip_size );
+    if( hauto > 0.0 )
+        t->hist = arena.take< int >( 2 << vi.format.bitsPerSample );
+    if( Bx || By )
+    {
+        t->tiles.stride  = Bxa * 2 + 2;
+        t->tiles.columns = (vi.width + Bxd - 1) / Bxd;
+        t->tiles.rows    = Ay / Byd * 2 + 1;
+        t->tiles.acc     = arena.take< double >( static_cast<size_t>(t->tiles.stride) * t->tiles.columns * t->tiles.rows );
+    }
+    else
+    {
+        t->dists = arena.take< double >( Axd * 2 );
+        t->vsums = arena.take< double >( vi.width );
+        if( t->ds )
         {
-            SDATA *ds = new SDATA();
-            t->ds = ds;
-            try { ds->sums    = new AlignedArrayObject< double, 16 >{ vi.width * vi.height }; }
-            catch( ... ) { throw bad_alloc{ "sums" }; }
-            try { ds->weights = new AlignedArrayObject< double, 16 >{ vi.width * vi.height }; }
-            catch( ... ) { throw bad_alloc{ "weights" }; }
-            try { ds->wmaxs   = new AlignedArrayObject< double, 16 >{ vi.width * vi.height }; }
-            catch( ... ) { throw bad_alloc{ "wmaxs" }; }
+            t->cols        = arena.take< double >( (Ay + 1) * Axd * Sxd );
+            t->ds->sums    = arena.take< double >( vi.width * vi.height );
+            t->ds->weights = arena.take< double >( vi.width * vi.height );
+            t->ds->wmaxs   = arena.take< double >( vi.width * vi.height );
         }
+    }
+    if( numNodes > 1 )
+        arena.bind( from, t->node );
+}
+
+nlThread *TNLMeans::CreateThread( int node )
+{
+    /* A slot beyond those of the constructor, placed in an arena of its own on
+     * the given node. Returns nullptr if it does not fit in max_memory or cannot
+     * be allocated. Called with mtx held. */
+    std::unique_ptr< nlThread > t( new ( std::nothrow ) nlThread );
+    std::unique_ptr< AlignedArena > own( new ( std::nothrow ) AlignedArena );
+    if( t == nullptr || own == nullptr )
+        return nullptr;
+    t->node = node;
+    try
+    {
+        InitThread( t.get() );
+        PlaceThread( t.get(), *own );
+        const size_t size = own->size() + FrameSize() * (Az * 2 + 1);
+        if( max_memory && footprint + size > max_memory )
+            return nullptr;
+        own->commit( hugepages );
+        PlaceThread( t.get(), *own );
+        footprint += size;
+    }
+    catch( ... ) { return nullptr; }
+    t->arena  = own.release();
+    t->active = true;
+    t->next   = extra;
+    extra     = t.get();
+    ++numSlots;
+    return t.release();
+}
+
+nlThread *TNLMeans::TakeThread( int node, bool anywhere )
+{
+    for( int i = 0; i < numThreads; ++i )
+        if( (anywhere || threads[i].node == node) && !threads[i].active && !threads[i].active.exchange( true ) )
+            return &threads[i];
+    for( nlThread *e = extra; e; e = e->next )
+        if( (anywhere || e->node == node) && !e->active && !e->active.exchange( true ) )
+            return e;
+    return nullptr;
+}
 
-        try { t->gw = new AlignedArrayObject< double, 16 >{ Sxd * Syd }; }
-        catch( ... ) { throw bad_alloc{ "gw" }; }
-        double *gw = t->gw->get();
-        int w = 0, m, n;
-        for( int j = -Sy; j <= Sy; ++j )
+nlThread *TNLMeans::AcquireThread()
+{
+    /* Every OS thread remembers the slot it last held in each filter and takes it
+     * back without locking, so with a slot per thread each keeps its own. A thread
+     * new to the filter, or whose slot is held by another, takes any free slot, or
+     * a new one while max_memory allows, and otherwise sleeps until a slot is
+     * released. The ids of filters are never reused, so entries of destroyed
+     * filters are only stale. The entries are a small table indexed by the id,
+     * where filters sharing an index evict each other, so nothing is allocated.
+     * On NUMA machines, slots on the node the thread runs on come first, and a
+     * thread moved to another node leaves its old slot to the threads there. */
+    struct Binding { uint64_t id; nlThread *slot; };
+    thread_local Binding bound[16] = {};
+    Binding &b = bound[id % 16];
+    const int node = numNodes > 1 ? AlignedMemory::numa_node() : 0;
+    if( b.id == id && b.slot->node == node && !b.slot->active.exchange( true ) )
+    {
+        b.slot->wait_us = 0;
+        return b.slot;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    /* Free slots on this node, then a new one, then free slots anywhere. */
+    nlThread *t = TakeThread( node, numNodes == 1 );
+    if( t == nullptr )
+    {
+        std::unique_lock< std::mutex > lock( mtx );
+        t = CreateThread( node );
+        if( t == nullptr )
         {
-            if( j < 0 )
-                m = std::min( j + By, 0 );
-            else
-                m = std::max( j - By, 0 );
-            for( int k = -Sx; k <= Sx; ++k )
-            {
-                if( k < 0 )
-                    n = std::min( k + Bx, 0 );
-                else
-                    n = std::max( k - Bx, 0 );
-                gw[w++] = std::exp( -((m * m + n * n) / (2 * a2)) );
-            }
+            ++waiting;
+            freed.wait( lock, [&]() { return (t = TakeThread( node, true )) != nullptr; } );
+            --waiting;
         }
     }
-    this->threads = threads.release();
+    t->wait_us = std::chrono::duration_cast< std::chrono::microseconds >( std::chrono::steady_clock::now() - start ).count();
+    b.id   = id;
+    b.slot = t;
+    return t;
 }
 
-TNLMeans::~TNLMeans()
+void TNLMeans::ReleaseThread( nlThread *t )
 {
-    delete [] threads;
+    /* A waiter counts itself before it looks for a free slot, so either it sees
+     * this one or it is counted here and gets woken. */
+    t->active = false;
+    if( waiting )
+    {
+        { std::lock_guard< std::mutex > lock( mtx ); }
+        freed.notify_one();
+    }
 }
 
 void TNLMeans::RequestFrame
 (
-    int             n,
-    VSFrameContext *frame_ctx,
-    VSCore         *core,
-    const VSAPI    *vsapi
+    int         n,
+    nlProvider *provider
 )
 {
     for( int i = n - Az; i <= n + Az; ++i )
-        vsapi->requestFrameFilter( mapn( i ), node, frame_ctx );
+        provider->request( mapn( i ), false );
+    if( masked )
+        provider->request( mapn( n ), true );
+    if( Az == 0 )
+        return;
+    /* After a few frames requested in order, the frame the next one will need
+     * is prefetched, so that it is produced upstream while this one is filtered.
+     * It is not requested: the host would hold this frame back until it is ready. */
+    if( last_request.exchange( n ) == n - 1 )
+        ++linear_run;
+    else
+        linear_run = 0;
+    if( linear_run >= 2 && n + Az + 1 < vi.numFrames )
+        provider->prefetch( n + Az + 1 );
+}
+
+void TNLMeans::PutFrame
+(
+    int              n,
+    const nlPicture *pf
+)
+{
+    if( source )
+        source->put( mapn( n ), pf );
+}
+
+int TNLMeans::MaxPictures() const
+{
+    /* Each call holds its source, mask, previous output and destination, and
+     * its thread keeps the window it searched. The shared source window, the
+     * last output of the recursive mode and a frame being prefetched come on
+     * top. */
+    return numThreads * (Az * 2 + 5) + (source ? source->size : 0) + 2;
+}
+
+const nlPicture *TNLMeans::FetchFrame
+(
+    int         n,
+    nlProvider *provider
+)
+{
+    const nlPicture *pf = source->get( mapn( n ) );
+    if( pf )
+        return pf;
+    ++source->misses;
+    pf = provider->fetch( mapn( n ), false );
+    if( pf )
+        source->put( mapn( n ), pf );
+    return pf;
+}
+
+void TNLMeans::ClampToScene( nlCache *fc, int &startz, int &stopz )
+{
+    /* Frames across a scene change are never searched. A cut between two frames
+     * counts if either side marks it, so both frames of a pair agree on it. */
+    for( int z = Az; z > startz; --z )
+        if( fc->frames[fc->getCachePos( z     )]->pf->cut_prev
+         || fc->frames[fc->getCachePos( z - 1 )]->pf->cut_next )
+        {
+            startz = z;
+            break;
+        }
+    for( int z = Az; z < stopz; ++z )
+        if( fc->frames[fc->getCachePos( z     )]->pf->cut_next
+         || fc->frames[fc->getCachePos( z + 1 )]->pf->cut_prev )
+        {
+            stopz = z;
+            break;
+        }
+}
+
+void TNLMeans::LoadFrames
+(
+    nlCache    *fc,
+    int         n,
+    nlProvider *provider
+)
+{
+    fc->resetCacheStart( n - Az, n + Az );
+    for( int i = n - Az; i <= n + Az; ++i )
+    {
+        nlFrame *nl = fc->frames[fc->getCachePos( i - n + Az )];
+        if( nl->fnum != i )
+        {
+            if( nl->pf )
+                nl->pf->release();
+            nl->pf = FetchFrame( i, provider );
+            if( nl->pf == nullptr )
+            {
+                nl->setFNum( -1 );
+                throw bad_frame{ "fetch failure (window)" };
+            }
+            nl->setFNum( i );
+        }
+        else
+            ++source->hits;
+    }
 }
 
 template < int ssd, typename pixel >
 void TNLMeans::GetFrameByMethod
 (
-    int             n,
-    const int       threadId,
-    const int       peak,
-    VSFrameRef     *dst,
-    VSFrameContext *frame_ctx,
-    VSCore         *core,
-    const VSAPI    *vsapi
+    int              n,
+    nlThread        *thread,
+    const int        peak,
+    const nlPicture *dst,
+    nlProvider      *provider
 )
 {
     if( Az )
     {
         if( Bx || By )
-            GetFrameWZB< ssd, pixel >( n, threadId, peak, dst, frame_ctx, core, vsapi );
+            GetFrameWZB< ssd, pixel >( n, thread, peak, dst, provider );
         else
-            GetFrameWZ< ssd, pixel >( n, threadId, peak, dst, frame_ctx, core, vsapi );
+            GetFrameWZ< ssd, pixel >( n, thread, peak, dst, provider );
     }
     else
     {
         if( Bx || By )
-            GetFrameWOZB< ssd, pixel >( n, threadId, peak, dst, frame_ctx, core, vsapi );
+            GetFrameWOZB< ssd, pixel >( n, thread, peak, dst, provider );
         else
-            GetFrameWOZ< ssd, pixel >( n, threadId, peak, dst, frame_ctx, core, vsapi );
+            GetFrameWOZ< ssd, pixel >( n, thread, peak, dst, provider );
     }
 }
 
-VSFrameRef *TNLMeans::GetFrame
+void TNLMeans::GetFrame
 (
-    int             n,
-    VSFrameContext *frame_ctx,
-    VSCore         *core,
-    const VSAPI    *vsapi
+    int              n,
+    const nlPicture *dst,
+    nlProvider      *provider,
+    nlReport        *report
 )
 {
-    ActiveThread thread( threads, numThreads, mtx );
+    const auto start = std::chrono::steady_clock::now();
+    const int  peak  = GetPixelMaxValue( vi.format.bitsPerSample );
 
-    int peak;
-    std::unique_ptr< const VSFrameRef, decltype( vsapi->freeFrame ) > unique_src
-    (
-        vsapi->getFrameFilter( mapn( n ), node, frame_ctx ),
-        vsapi->freeFrame
-    );
-    const VSFrameRef *src = unique_src.get();
-    if( src )
+    nlPictureRef unique_src( provider->fetch( mapn( n ), false ) );
+    const nlPicture *src = unique_src.get();
+    if( src == nullptr )
+        throw bad_frame{ "fetch failure (src)" };
+
+    nlPictureRef unique_mask;
+    if( masked )
     {
-        const VSFormat *format = vsapi->getFrameFormat( src );
+        unique_mask.reset( provider->fetch( mapn( n ), true ) );
+        if( unique_mask == nullptr )
+            throw bad_frame{ "fetch failure (mask)" };
+    }
 
-        if( format->colorFamily == cmCompat )
-        {
-            vsapi->setFilterError( "TNLMeans:  only planar formats are supported", frame_ctx );
-            return nullptr;
-        }
-        if( format->sampleType != stInteger )
-        {
-            vsapi->setFilterError( "TNLMeans:  sample type must be integer!", frame_ctx );
-            return nullptr;
-        }
+    ActiveThread thread( this, AcquireThread() );
+    nlThread *t = thread.GetThread();
+    t->comparisons = 0;
+    t->pruned      = 0;
+    t->cache_hits  = 0;
 
-        const int bps = format->bitsPerSample;
-        if( bps <= 0 || bps > 16 )
-        {
-            vsapi->setFilterError( "TNLMeans:  bitsPerSample must be 1 to 16!", frame_ctx );
-            return nullptr;
-        }
-        peak = GetPixelMaxValue( bps );
-    }
-    else
+    /* The recursive mode searches the output of the previous frame too, if it was
+     * the last frame filtered. Otherwise the recursion starts over at this frame. */
+    nlPictureRef unique_prev;
+    if( recent )
     {
-        vsapi->setFilterError( "TNLMeans:  getFrameFilter failure (src)!", frame_ctx );
-        return nullptr;
+        std::lock_guard< std::mutex > lock( mtx );
+        if( recent->fnum == n - 1 && recent->pf && !src->cut_prev && !recent->pf->cut_next )
+            unique_prev.reset( recent->pf->retain() );
     }
+    t->prev  = unique_prev.get();
+    t->maskf = unique_mask.get();
 
-    std::unique_ptr< VSFrameRef, decltype( vsapi->freeFrame ) > unique_dst
-    (
-        vsapi->newVideoFrame
-        (
-            vsapi->getFrameFormat( src ),
-            vsapi->getFrameWidth ( src, 0 ),
-            vsapi->getFrameHeight( src, 0 ),
-            src, core
-        ),
-        vsapi->freeFrame
-    );
-    VSFrameRef *dst = unique_dst.get();
-    if( dst == nullptr )
-    {
-        vsapi->setFilterError( "TNLMeans:  newVideoFrame failure (dst)!", frame_ctx );
-        return nullptr;
+    /* The skip maps of this frame are built before any engine runs, so that the
+     * noise estimate of hauto shares their pass over the frame. */
+    double sigma[3] = {};
+    double *estimate = hauto > 0.0 ? sigma : nullptr;
+    if( skipping )
+        t->pruned = peak <= 255 ? BuildSkipMaps< uint8_t  >( src, t->maskf, peak, t->skip, estimate, t->hist )
+                                : BuildSkipMaps< uint16_t >( src, t->maskf, peak, t->skip, estimate, t->hist );
+    else if( estimate )
+        for( int plane = 0; plane < vi.format.numPlanes; ++plane )
+            sigma[plane] = peak <= 255 ? EstimateNoise< uint8_t  >( src, plane, t->hist )
+                                       : EstimateNoise< uint16_t >( src, plane, t->hist );
+
+    /* With hauto, h follows the noise estimated in each plane of this frame.
+     * For sad, it is scaled by the ratio of the default values of h. */
+    for( int plane = 0; plane < vi.format.numPlanes; ++plane )
+    {
+        double hp = h;
+        if( estimate )
+            hp = hauto * std::max( sigma[plane], 0.25 ) * (use_ssd ? 1.0 : 0.5 / 1.8);
+        report->sigma[plane] = sigma[plane];
+        report->h[plane] = hp;
+        t->hs[plane] = use_ssd ? -1.0 / (hp * hp) : -1.0 / hp;
     }
 
     unique_src.reset();
@@ -240,143 +605,670 @@ VSFrameRef *TNLMeans::GetFrame
     if( peak <= 255 )
     {
         if( use_ssd )
-            GetFrameByMethod< 1, uint8_t >( n, thread.GetId(), peak, dst, frame_ctx, core, vsapi );
+            GetFrameByMethod< 1, uint8_t >( n, t, peak, dst, provider );
         else
-            GetFrameByMethod< 0, uint8_t >( n, thread.GetId(), peak, dst, frame_ctx, core, vsapi );
+            GetFrameByMethod< 0, uint8_t >( n, t, peak, dst, provider );
     }
     else
     {
         if( use_ssd )
-            GetFrameByMethod< 1, uint16_t >( n, thread.GetId(), peak, dst, frame_ctx, core, vsapi );
+            GetFrameByMethod< 1, uint16_t >( n, t, peak, dst, provider );
         else
-            GetFrameByMethod< 0, uint16_t >( n, thread.GetId(), peak, dst, frame_ctx, core, vsapi );
+            GetFrameByMethod< 0, uint16_t >( n, t, peak, dst, provider );
+    }
+
+    report->engine        = Az ? ((Bx || By) ? "WZB" : "WZ") : ((Bx || By) ? "WOZB" : "WOZ");
+    report->time_us       = std::chrono::duration_cast< std::chrono::microseconds >( std::chrono::steady_clock::now() - start ).count();
+    report->comparisons   = t->comparisons;
+    report->pruned        = t->pruned;
+    report->cache_hits    = t->cache_hits;
+    report->wait_us       = t->wait_us;
+    report->source_hits   = source ? int64_t(source->hits)   : 0;
+    report->source_misses = source ? int64_t(source->misses) : 0;
+    report->simd          = kernels.name;
+    report->slots         = numSlots;
+    report->footprint     = footprint;
+
+    if( recent )
+    {
+        std::lock_guard< std::mutex > lock( mtx );
+        if( recent->pf )
+            recent->pf->release();
+        recent->pf = dst->retain();
+        recent->setFNum( n );
+    }
+}
+
+template < typename pixel >
+void TNLMeans::EstimateMotion
+(
+    const pixel *pfp,
+    const pixel *pcp,
+    const int    pitch,
+    const int    width,
+    const int    height,
+    int         *mv
+)
+{
+    /* Find for every block of pfp the integer displacement into pcp with the
+     * lowest sum of absolute differences. The range is searched on a grid of
+     * two pixels first, then refined around the best grid point. Ties prefer
+     * the shorter vector, so flat areas keep the zero vector. */
+    for( int by = 0; by < mvh; ++by )
+    {
+        const int y0 = by * me_block;
+        const int y1 = std::min( y0 + me_block, height );
+        for( int bx = 0; bx < mvw; ++bx, mv += 2 )
+        {
+            const int x0 = bx * me_block;
+            const int x1 = std::min( x0 + me_block, width );
+            const int minx = std::max( -me_range, -x0 ), maxx = std::min( me_range, width  - x1 );
+            const int miny = std::max( -me_range, -y0 ), maxy = std::min( me_range, height - y1 );
+            mv[0] = mv[1] = 0;
+            if( x0 >= width || y0 >= height )
+                continue;
+            auto sad = [&]( int dx, int dy ) -> uint64_t
+            {
+                uint64_t sum = 0;
+                const pixel *s1 = GetPixel( pfp, y0 * pitch );
+                const pixel *s2 = GetPixel( pcp, (y0 + dy) * pitch ) + dx;
+                for( int j = y0; j < y1; ++j )
+                {
+                    for( int k = x0; k < x1; ++k )
+                        sum += std::abs( s1[k] - s2[k] );
+                    ForwardPointer( s1, pitch );
+                    ForwardPointer( s2, pitch );
+                }
+                return sum;
+            };
+            uint64_t best = sad( 0, 0 );
+            int bdx = 0, bdy = 0;
+            auto check = [&]( int dx, int dy )
+            {
+                if( dx < minx || dx > maxx || dy < miny || dy > maxy ) return;
+                const uint64_t cost = sad( dx, dy );
+                if( cost < best || (cost == best && std::abs( dx ) + std::abs( dy ) < std::abs( bdx ) + std::abs( bdy )) )
+                {
+                    best = cost;
+                    bdx  = dx;
+                    bdy  = dy;
+                }
+            };
+            for( int dy = -(me_range & ~1); dy <= me_range; dy += 2 )
+                for( int dx = -(me_range & ~1); dx <= me_range; dx += 2 )
+                    if( dx || dy )
+                        check( dx, dy );
+            const int cdx = bdx, cdy = bdy;
+            for( int dy = cdy - 1; dy <= cdy + 1; ++dy )
+                for( int dx = cdx - 1; dx <= cdx + 1; ++dx )
+                    if( dx != cdx || dy != cdy )
+                        check( dx, dy );
+            mv[0] = bdx;
+            mv[1] = bdy;
+        }
+    }
+}
+
+/* The noise is estimated from the median absolute deviation of the diagonal
+ * Haar detail over 2x2 blocks. The detail is p00 - p01 - p10 + p11, so its
+ * deviation is twice sigma. NoiseRows adds the blocks of the row pair at s0
+ * to hist, and NoiseSigma takes sigma from the 'count' blocks added. */
+template < typename pixel >
+void TNLMeans::NoiseRows
+(
+    const pixel *s0,
+    const int    pitch,
+    const int    width,
+    int         *hist
+)
+{
+    const pixel *s1 = GetPixel( s0, pitch );
+    for( int x = 0; x < (width & ~1); x += 2 )
+        ++hist[std::abs( s0[x] - s0[x + 1] - s1[x] + s1[x + 1] )];
+}
+
+double TNLMeans::NoiseSigma
+(
+    const int    *hist,
+    const int64_t count
+)
+{
+    if( count == 0 )
+        return 0.0;
+    int64_t seen = 0;
+    int median = 0;
+    while( (seen += hist[median]) * 2 < count )
+        ++median;
+    return median / (2 * 0.6745);
+}
+
+template < typename pixel >
+double TNLMeans::EstimateNoise
+(
+    const nlPicture *pf,
+    const int        plane,
+    int             *hist
+)
+{
+    const pixel *srcp   = reinterpret_cast<const pixel *>(pf->rptr[plane]);
+    const int    pitch  = pf->stride[plane];
+    const int    height = pf->height[plane] & ~1;
+    const int    width  = pf->width[plane];
+    std::fill_n( hist, 2 << vi.format.bitsPerSample, 0 );
+    for( int y = 0; y < height; y += 2 )
+        NoiseRows( GetPixel( srcp, y * pitch ), pitch, width, hist );
+    return NoiseSigma( hist, int64_t(height / 2) * (width / 2) );
+}
+
+template < typename pixel >
+int64_t TNLMeans::BuildSkipMaps
+(
+    const nlPicture *srcPF,
+    const nlPicture *maskPF,
+    const int        peak,
+    uint8_t         *skip,
+    double          *sigma,
+    int             *hist
+)
+{
+    /* A pixel is not searched if the mask is 0 there, or if its whole patch lies
+     * within 'flat' (in 8-bit steps) of its value range. Masked pixels are copied
+     * and flat ones get the average of their patch. Returns the number of pixels
+     * left out. With sigma, the noise of each plane is estimated in the same
+     * pass, from each pair of rows once the second one is done. */
+    int64_t skipped = 0;
+    const int threshold = flat * peak / 255;
+    for( int plane = 0; plane < vi.format.numPlanes; ++plane )
+    {
+        const pixel *srcp   = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+        const int    pitch  = srcPF->stride[plane];
+        const int    height = srcPF->height[plane];
+        const int    width  = srcPF->width[plane];
+        const pixel *maskp  = maskPF ? reinterpret_cast<const pixel *>(maskPF->rptr[plane]) : nullptr;
+        const int    mpitch = maskPF ? maskPF->stride[plane] : 0;
+        uint8_t     *skipp  = skip + skip_offset[plane];
+        if( sigma )
+            std::fill_n( hist, 2 << vi.format.bitsPerSample, 0 );
+        for( int y = 0; y < height; ++y )
+        {
+            const int yT = std::max( y - Sy, 0 );
+            const int yB = std::min( y + Sy, height - 1 );
+            for( int x = 0; x < width; ++x )
+            {
+                uint8_t type = SKIP_NONE;
+                if( maskp && GetPixelValue( maskp + x, y * mpitch ) == 0 )
+                    type = SKIP_COPY;
+                else if( flat )
+                {
+                    const int xL = std::max( x - Sx, 0 );
+                    const int xR = std::min( x + Sx, width - 1 );
+                    int lo = GetPixelValue( srcp + x, y * pitch ), hi = lo;
+                    for( int j = yT; j <= yB && hi - lo <= threshold; ++j )
+                    {
+                        const pixel *s = GetPixel( srcp, j * pitch );
+                        for( int k = xL; k <= xR; ++k )
+                        {
+                            lo = std::min( lo, int(s[k]) );
+                            hi = std::max( hi, int(s[k]) );
+                        }
+                    }
+                    if( hi - lo <= threshold )
+                        type = SKIP_FLAT;
+                }
+                skipp[y * width + x] = type;
+                skipped += type != SKIP_NONE;
+            }
+            if( sigma && (y & 1) )
+                NoiseRows( GetPixel( srcp, (y - 1) * pitch ), pitch, width, hist );
+        }
+        if( sigma )
+            sigma[plane] = NoiseSigma( hist, int64_t(height / 2) * (width / 2) );
+    }
+    return skipped;
+}
+
+template < typename pixel >
+pixel TNLMeans::SkippedValue
+(
+    const pixel  *pfp,
+    const int     pitch,
+    const int     width,
+    const int     height,
+    const int     x,
+    const int     y,
+    const uint8_t type
+)
+{
+    if( type == SKIP_COPY )
+        return GetPixelValue( pfp + x, y * pitch );
+    const int xL = std::max( x - Sx, 0 ), xR = std::min( x + Sx, width  - 1 );
+    const int yT = std::max( y - Sy, 0 ), yB = std::min( y + Sy, height - 1 );
+    int64_t sum = 0;
+    for( int j = yT; j <= yB; ++j )
+    {
+        const pixel *s = GetPixel( pfp, j * pitch );
+        for( int k = xL; k <= xR; ++k )
+            sum += s[k];
+    }
+    const int64_t count = static_cast<int64_t>(xR - xL + 1) * (yB - yT + 1);
+    return static_cast<pixel>((sum + count / 2) / count);
+}
+
+template < typename pixel >
+bool TNLMeans::SkipBlock
+(
+    const uint8_t *skip,
+    const pixel   *pfp,
+    pixel         *dstp,
+    const int      pitch,
+    const int      width,
+    const int      height,
+    const int      x0,
+    const int      y0,
+    const int      xTr,
+    const int      yTr
+)
+{
+    /* A block is only left out if none of its pixels need the search. */
+    for( int j = 0; j < yTr; ++j )
+        for( int k = 0; k < xTr; ++k )
+            if( skip[(y0 + j) * width + x0 + k] == SKIP_NONE )
+                return false;
+    for( int j = 0; j < yTr; ++j )
+    {
+        for( int k = 0; k < xTr; ++k )
+            dstp[k] = SkippedValue( pfp, pitch, width, height, x0 + k, y0 + j, skip[(y0 + j) * width + x0 + k] );
+        ForwardPointer( dstp, pitch );
+    }
+    return true;
+}
+
+template < int ssd, typename pixel >
+void TNLMeans::RowDistances
+(
+    const pixel   *s1,
+    const pixel   *s2,
+    const int      pitch,
+    const double  *gwT,
+    const int      x,
+    const int      startx,
+    const int      stopx,
+    const int      yT,
+    const int      yB,
+    const int      widthm1,
+    const uint8_t *skip,
+    double        *dists
+)
+{
+    /* Distances of the patch of s2, centred on column x, to the patches of the row s1
+     * centred on the columns startx .. stopx, into dists[v - startx], and their
+     * gweights into dists[Axd + v - startx]. Columns set in skip are left out. The
+     * patches away from the left and right edges are clamped the same way, and the
+     * runs of them are compared as strips sharing one gweights. */
+    const nlPatchDistance distance = kernels.distance[ssd][sizeof( pixel ) - 1];
+    const nlStripDistance strip    = kernels.strip   [ssd][sizeof( pixel ) - 1];
+    double *gws = dists + Axd;
+    const int xLs = -std::min( Sx, x );
+    const int xRs =  std::min( Sx, widthm1 - x );
+    const int vL  = std::max( startx, Sx );
+    const int vR  = std::min( stopx, widthm1 - Sx );
+    double gstrip = -1.0;
+    for( int v = startx; v <= stopx; ++v )
+    {
+        if( skip && skip[v] ) continue;
+        int run = 1;
+        if( v >= vL )
+            while( v + run <= vR && !(skip && skip[v + run]) )
+                ++run;
+        if( run > 1 )
+        {
+            StripDistance< ssd >( strip, s1 + v, s2, pitch, gwT, xLs, xRs, yT, yB, run, dists + v - startx );
+            if( gstrip < 0.0 )
+            {
+                gstrip = 0.0;
+                const double *gwTT = gwT;
+                for( int j = yT; j <= yB; ++j, gwTT += Sxd )
+                    for( int k = xLs; k <= xRs; ++k )
+                        gstrip += gwTT[k];
+            }
+            std::fill_n( gws + v - startx, run, gstrip );
+            v += run - 1;
+            continue;
+        }
+        const int xL = -std::min( std::min( Sx, v ), x );
+        const int xR =  std::min( std::min( Sx, widthm1 - v ), widthm1 - x );
+        double &gweights = gws[v - startx] = 0.0;
+        dists[v - startx] = PatchDistance< ssd >( distance, s1 + v, s2, pitch, gwT, xL, xR, yT, yB, gweights );
+    }
+}
+
+template < int ssd, typename pixel >
+int64_t TNLMeans::CompareOffsets
+(
+    const pixel   *pfp,
+    const pixel   *pcp,
+    const int      pitch,
+    const int      width,
+    const int      height,
+    const double  *gw,
+    double        *vsums,
+    SDATA         *dds,
+    SDATA         *cds,
+    const uint8_t *skip,
+    const double   hs
+)
+{
+    /* CompareFrames without motion vectors. Each row y of pfp is compared with pcp one
+     * search offset (du, dv) at a time: the weighted differences of the whole row are
+     * summed over the patch rows first, into vsums, and then over the patch columns,
+     * gw being the outer product of its centre column and row. */
+    int64_t comparisons = 0;
+    const bool intra    = pfp == pcp;
+    const int  heightm1 = height - 1;
+    const int  widthm1  = width  - 1;
+    const double *gwx = gw + Sy * Sxd + Sx;
+    const double *gwy = gwx;
+    for( int y = 0; y < height; ++y )
+    {
+        const int doffy = y * width;
+        clear_rows_d( dds, intra ? std::min( y + Ay, heightm1 ) : y, width );
+        if( cds && !intra )
+            clear_rows_d( cds, std::min( y + Ay, heightm1 ), width );
+        for( int u = intra ? y : std::max( y - Ay, 0 ); u <= std::min( y + Ay, heightm1 ); ++u )
+        {
+            const int yT = -std::min( std::min( Sy, u ), y );
+            const int yB =  std::min( std::min( Sy, heightm1 - u ), heightm1 - y );
+            double gwys = 0.0;
+            for( int j = yT; j <= yB; ++j )
+                gwys += gwy[j * Sxd];
+            const int pcpl  = u * pitch;
+            const int coffy = u * width;
+            for( int dv = (intra && u == y) ? 1 : -Ax; dv <= Ax; ++dv )
+            {
+                const int x0 = std::max( -dv, 0 );
+                const int x1 = std::min( widthm1 - dv, widthm1 );
+                if( x0 > x1 ) continue;
+                fill_zero_d( vsums + x0, x1 - x0 + 1 );
+                const pixel  *s1 = GetPixel( pcp, (u + yT) * pitch );
+                const pixel  *s2 = GetPixel( pfp, (y + yT) * pitch );
+                const double *gwyT = gwy + yT * Sxd;
+                for( int j = yT; j <= yB; ++j )
+                {
+                    for( int x = x0; x <= x1; ++x )
+                        vsums[x] += (ssd ? Square( s1[x + dv] - s2[x] ) : std::abs( s1[x + dv] - s2[x] )) * *gwyT;
+                    ForwardPointer( s1, pitch );
+                    ForwardPointer( s2, pitch );
+                    gwyT += Sxd;
+                }
+                for( int x = x0; x <= x1; ++x )
+                {
+                    const int v = x + dv;
+                    const bool dskip = skip && skip[doffy + x];
+                    if( dskip && (!cds || (intra && skip[coffy + v])) ) continue;
+                    const int xL = -std::min( std::min( Sx, v ), x );
+                    const int xR =  std::min( std::min( Sx, widthm1 - v ), widthm1 - x );
+                    double diff = 0.0, gwxs = 0.0;
+                    for( int k = xL; k <= xR; ++k )
+                    {
+                        diff += gwx[k] * vsums[x + k];
+                        gwxs += gwx[k];
+                    }
+                    const double gweights = gwxs * gwys;
+                    const double weight = ssd ? GetSSDWeight( diff, gweights, hs ) : GetSADWeight( diff, gweights, hs );
+                    ++comparisons;
+                    if( !dskip )
+                    {
+                        const int doff = doffy + x;
+                        dds->weights[doff] += weight;
+                        dds->sums   [doff] += weight * GetPixelValue( pcp + v, pcpl );
+                        if( weight > dds->wmaxs[doff] ) dds->wmaxs[doff] = weight;
+                    }
+                    if( cds )
+                    {
+                        const int coff = coffy + v;
+                        cds->weights[coff] += weight;
+                        cds->sums   [coff] += weight * GetPixelValue( pfp + x, y * pitch );
+                        if( weight > cds->wmaxs[coff] ) cds->wmaxs[coff] = weight;
+                    }
+                }
+            }
+        }
     }
+    return comparisons;
+}
 
-    return unique_dst.release();
+template < int ssd, typename pixel >
+int64_t TNLMeans::CompareFrames
+(
+    const pixel  *pfp,
+    const pixel  *pcp,
+    const int     pitch,
+    const int     width,
+    const int     height,
+    const double *gw,
+    double       *dists,
+    double       *vsums,
+    SDATA        *dds,
+    SDATA        *cds,
+    const int    *mv,
+    const int     shx,
+    const int     shy,
+    const uint8_t *skip,
+    const double  hs
+)
+{
+    /* Compare every pixel of the frame pfp with the search window around it in the
+     * frame pcp. The weight of each pair is added to dds for the pixel of pfp and,
+     * if cds is given, to cds for the pixel of pcp. When both are the same frame,
+     * only the half of the window after the pixel is searched. With motion vectors,
+     * the window is centred on the position the block of the pixel moved to.
+     * Skipped pixels of pfp are not searched, unless the pixel of pcp may need
+     * the weight: within the same frame, or when it is delivered to cds. The skip
+     * map is that of pfp, so across frames it says nothing about the pixel of pcp,
+     * and every pair of a skipped pixel is then compared for cds alone.
+     * Returns the number of pairs compared. */
+    if( mv == nullptr )
+        return CompareOffsets< ssd >( pfp, pcp, pitch, width, height, gw, vsums, dds, cds, skip, hs );
+    int64_t comparisons = 0;
+    const double *gws = dists + Axd;
+    const bool intra    = pfp == pcp;
+    const int  heightm1 = height - 1;
+    const int  widthm1  = width  - 1;
+    for( int y = 0; y < height; ++y )
+    {
+        const int doffy  = y * width;
+        const int pfpl   = y * pitch;
+        clear_rows_d( dds, intra ? std::min( y + Ay, heightm1 ) : y, width );
+        if( cds && !intra )
+            clear_rows_d( cds, std::min( y + Ay, heightm1 ), width );
+        for( int x = 0; x < width; ++x )
+        {
+            const bool dskip = skip && skip[doffy + x];
+            if( dskip && !intra && !cds ) continue;
+            int dx, dy;
+            GetMotion( mv, x, y, shx, shy, dx, dy );
+            const int starty  = intra ? y : std::max( y + dy - Ay, 0 );
+            const int stopy   = std::min( y + dy + Ay, heightm1 );
+            const int startxt = std::max( x + dx - Ax, 0 );
+            const int stopx   = std::min( x + dx + Ax, widthm1 );
+            const int doff = doffy + x;
+            double *dsum    = &dds->sums   [doff];
+            double *dweight = &dds->weights[doff];
+            double *dwmax   = &dds->wmaxs  [doff];
+            const pixel srcx = GetPixelValue( pfp + x, pfpl );
+            for( int u = starty; u <= stopy; ++u )
+            {
+                const int startx = (intra && u == y) ? x+1 : startxt;
+                const int yT = -std::min( std::min( Sy, u ), y );
+                const int yB =  std::min( std::min( Sy, heightm1 - u ), heightm1 - y );
+                const pixel *s1_saved = GetPixel( pcp,     (u+yT)*pitch );
+                const pixel *s2_saved = GetPixel( pfp + x, (y+yT)*pitch );
+                const double *gw_saved = gw+(yT+Sy)*Sxd+Sx;
+                const int pcpl  = u * pitch;
+                const int coffy = u * width;
+                RowDistances< ssd >( s1_saved, s2_saved, pitch, gw_saved, x, startx, stopx, yT, yB, widthm1,
+                                     (dskip && intra) ? skip + coffy : nullptr, dists );
+                for( int v = startx; v <= stopx; ++v )
+                {
+                    if( dskip && intra && skip[coffy + v] ) continue;
+                    const double diff     = dists[v - startx];
+                    const double gweights = gws  [v - startx];
+                    const double weight = ssd ? GetSSDWeight( diff, gweights, hs ) : GetSADWeight( diff, gweights, hs );
+                    ++comparisons;
+                    if( !dskip )
+                    {
+                        *dweight += weight;
+                        *dsum    += weight*GetPixelValue( pcp + v, pcpl );
+                        if( weight > *dwmax ) *dwmax = weight;
+                    }
+                    if( cds )
+                    {
+                        const int coff = coffy + v;
+                        double *csum    = &cds->sums   [coff];
+                        double *cweight = &cds->weights[coff];
+                        double *cwmax   = &cds->wmaxs  [coff];
+                        *cweight += weight;
+                        *csum    += weight*srcx;
+                        if( weight > *cwmax ) *cwmax = weight;
+                    }
+                }
+            }
+        }
+    }
+    return comparisons;
 }
 
 template < int ssd, typename pixel >
 void TNLMeans::GetFrameWZ
 (
-    int             n,
-    const int       threadId,
-    const int       peak,
-    VSFrameRef     *dstPF,
-    VSFrameContext *frame_ctx,
-    VSCore         *core,
-    const VSAPI    *vsapi
+    int              n,
+    nlThread        *thread,
+    const int        peak,
+    const nlPicture *dstPF,
+    nlProvider      *provider
 )
 {
-    nlCache *fc = threads[threadId].fc;
-    double  *gw = threads[threadId].gw->get();
-    fc->resetCacheStart( n - Az, n + Az );
-    for( int i = n - Az; i <= n + Az; ++i )
+    nlCache *fc    = thread->fc;
+    nlFrame *own   = thread->own;
+    nlFrame *other = thread->other;
+    double  *dists = thread->dists;
+    double  *vsums = thread->vsums;
+    const double *hp = thread->hs;
+    int64_t comparisons = 0;
+    LoadFrames( fc, n, provider );
+    nlFrame **partners = fc->partners;
+    int      *plan     = fc->plan;
+    const nlPicture *srcPF = fc->frames[fc->getCachePos( Az )]->pf;
+    int startz = Az - std::min( n, Az );
+    int stopz  = Az + std::min( vi.numFrames - n - 1, Az );
+    ClampToScene( fc, startz, stopz );
+    /* Frame pairs already compared for a neighbour are delivered through the window. */
+    nlFrame *cur = nullptr;
+    nlWindow *window = windows.empty() ? nullptr : windows[thread->node].get();
+    if( window )
+        cur = window->claim( n, Az, startz, stopz, sequential, plan, partners );
+    else
+        for( int z = startz; z <= stopz; ++z )
+        {
+            plan    [z] = z != Az;
+            partners[z] = nullptr;
+        }
+    for( int z = startz; z <= stopz; ++z )
+        thread->cache_hits += z != Az && plan[z] == 0;
+    if( me_range )
+        for( int z = startz; z <= stopz; ++z )
+            if( z != Az )
+                EstimateMotion
+                (
+                    reinterpret_cast<const pixel *>(srcPF->rptr[0]),
+                    reinterpret_cast<const pixel *>(fc->frames[fc->getCachePos( z )]->pf->rptr[0]),
+                    dstPF->stride[0],
+                    dstPF->width[0],
+                    dstPF->height[0],
+                    thread->mvs + z * mvw * mvh * 2
+                );
+    uint8_t *skip = skipping ? thread->skip : nullptr;
+    for( int plane = 0; plane < vi.format.numPlanes; ++plane )
     {
-        nlFrame *nl = fc->frames[fc->getCachePos( i - n + Az )];
-        if( nl->fnum != i )
+        const pixel *srcp  = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+        const int    pitch  = dstPF->stride[plane];
+        const int    height = dstPF->height[plane];
+        const int    width  = dstPF->width[plane];
+        own->ds[plane]->cleared = 0;
+        comparisons += CompareFrames< ssd >( srcp, srcp, pitch, width, height, gw, dists, vsums, own->ds[plane], own->ds[plane], nullptr, 0, 0,
+                                             skip ? skip + skip_offset[plane] : nullptr, hp[plane] );
+    }
+    for( int z = startz; z <= stopz; ++z )
+    {
+        if( plan[z] == 0 ) continue;
+        nlFrame *partner = partners[z];
+        const int *mv = me_range ? thread->mvs + z * mvw * mvh * 2 : nullptr;
+        for( int plane = 0; plane < vi.format.numPlanes; ++plane )
         {
-            vsapi->freeFrame( nl->pf );
-            nl->pf = vsapi->getFrameFilter( mapn( i ), node, frame_ctx );
-            nl->setFNum( i );
-            fc->clearDS( nl );
+            const int shx = plane ? vi.format.subSamplingW : 0;
+            const int shy = plane ? vi.format.subSamplingH : 0;
+            const pixel *srcp = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+            const pixel *pf1p = reinterpret_cast<const pixel *>(fc->frames[fc->getCachePos( z )]->pf->rptr[plane]);
+            const int pitch  = dstPF->stride[plane];
+            const int height = dstPF->height[plane];
+            const int width  = dstPF->width[plane];
+            SDATA *cds = partner ? other->ds[plane] : nullptr;
+            if( cds )
+                cds->cleared = 0;
+            comparisons += CompareFrames< ssd >( srcp, pf1p, pitch, width, height, gw, dists, vsums, own->ds[plane], cds, mv, shx, shy,
+                                                 skip ? skip + skip_offset[plane] : nullptr, hp[plane] );
         }
+        if( partner )
+            window->deliver( partner, Azdm1 - z, other );
     }
-    std::unique_ptr< AlignedArrayObject< const pixel *, 16 > > _pfplut( new AlignedArrayObject< const pixel *, 16 >{ fc->size } );
-    std::unique_ptr< AlignedArrayObject< const SDATA *, 16 > > _dslut ( new AlignedArrayObject< const SDATA *, 16 >{ fc->size } );
-    std::unique_ptr< AlignedArrayObject<       int   *, 16 > > _dsalut( new AlignedArrayObject<       int   *, 16 >{ fc->size } );
-    const pixel **pfplut = _pfplut.get()->get();
-    const SDATA **dslut  = _dslut.get()->get();
-    int         **dsalut = _dsalut.get()->get();
-    for( int i = 0; i < fc->size; ++i )
-        dsalut[i] = fc->frames[fc->getCachePos( i )]->dsa;
-    int *ddsa = dsalut[Az];
-    const VSFrameRef *srcPF = fc->frames[fc->getCachePos( Az )]->pf;
-    const int startz = Az - std::min( n, Az );
-    const int stopz  = Az + std::min( vi.numFrames - n - 1, Az );
-    for( int plane = 0; plane < vi.format->numPlanes; ++plane )
-    {
-        const pixel *srcp = reinterpret_cast<const pixel *>(vsapi->getReadPtr( srcPF, plane ));
-        const pixel *pf2p = reinterpret_cast<const pixel *>(vsapi->getReadPtr( srcPF, plane ));
-        pixel    *dstp     = reinterpret_cast<pixel *>(vsapi->getWritePtr( dstPF, plane ));
-        const int pitch    = vsapi->getStride     ( dstPF, plane );
-        const int height   = vsapi->getFrameHeight( dstPF, plane );
-        const int width    = vsapi->getFrameWidth ( dstPF, plane );
-        const int heightm1 = height - 1;
-        const int widthm1  = width  - 1;
-        for( int i = 0; i < fc->size; ++i )
+    if( const nlPicture *prevPF = thread->prev )
+    {
+        /* The previous output is aligned with the previous source frame. */
+        const int *mv = (me_range && startz < Az) ? thread->mvs + (Az - 1) * mvw * mvh * 2 : nullptr;
+        for( int plane = 0; plane < vi.format.numPlanes; ++plane )
         {
-            const int pos = fc->getCachePos( i );
-            pfplut[i] = reinterpret_cast<const pixel *>(vsapi->getReadPtr( fc->frames[pos]->pf, plane ));
-            dslut [i] = fc->frames[pos]->ds[plane];
+            const pixel *srcp  = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+            const pixel *prevp = reinterpret_cast<const pixel *>(prevPF->rptr[plane]);
+            const int pitch  = dstPF->stride[plane];
+            const int height = dstPF->height[plane];
+            const int width  = dstPF->width[plane];
+            comparisons += CompareFrames< ssd >( srcp, prevp, pitch, width, height, gw, dists, vsums, own->ds[plane], nullptr, mv,
+                                                 plane ? vi.format.subSamplingW : 0, plane ? vi.format.subSamplingH : 0,
+                                                 skip ? skip + skip_offset[plane] : nullptr, hp[plane] );
         }
-        const SDATA *dds = dslut[Az];
+    }
+    thread->comparisons += comparisons;
+    if( cur )
+    {
+        window->wait( cur, startz, stopz );
+        for( int plane = 0; plane < vi.format.numPlanes; ++plane )
+            add_ds( own->ds[plane], cur->ds[plane] );
+        window->finish( cur );
+    }
+    for( int plane = 0; plane < vi.format.numPlanes; ++plane )
+    {
+        const pixel *srcp   = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+        const pixel *pfp    = srcp;
+        pixel       *dstp   = reinterpret_cast<pixel *>(dstPF->wptr[plane]);
+        const int    pitch  = dstPF->stride[plane];
+        const int    height = dstPF->height[plane];
+        const int    width  = dstPF->width[plane];
+        const SDATA *dds    = own->ds[plane];
+        const uint8_t *skipp = skip ? skip + skip_offset[plane] : nullptr;
         for( int y = 0; y < height; ++y )
         {
-            const int startyt = std::max( y - Ay, 0 );
-            const int stopy   = std::min( y + Ay, heightm1 );
-            const int doffy   = y * width;
+            const int doffy = y * width;
             for( int x = 0; x < width; ++x )
             {
-                const int startxt = std::max( x - Ax, 0 );
-                const int stopx   = std::min( x + Ax, widthm1 );
                 const int doff = doffy + x;
-                double *dsum    = &dds->sums->get()   [doff];
-                double *dweight = &dds->weights->get()[doff];
-                double *dwmax   = &dds->wmaxs->get()  [doff];
-                for( int z = startz; z <= stopz; ++z )
+                if( skipp && skipp[doff] )
                 {
-                    if( ddsa[z] == 1 ) continue;
-                    else ddsa[z] = 2;
-                    const int starty = (z == Az) ? y : startyt;
-                    const SDATA *cds = dslut[z];
-                    int *cdsa = dsalut[z];
-                    const pixel *pf1p = pfplut[z];
-                    for( int u = starty; u <= stopy; ++u )
-                    {
-                        const int startx = (u == y && z == Az) ? x+1 : startxt;
-                        const int yT = -std::min( std::min( Sy, u ), y );
-                        const int yB =  std::min( std::min( Sy, heightm1 - u ), heightm1 - y );
-                        const pixel *s1_saved = GetPixel( pf1p,     (u+yT)*pitch );
-                        const pixel *s2_saved = GetPixel( pf2p + x, (y+yT)*pitch );
-                        const double *gw_saved = gw+(yT+Sy)*Sxd+Sx;
-                        const int pf1pl = u * pitch;
-                        const int coffy = u * width;
-                        for( int v = startx; v <= stopx; ++v )
-                        {
-                            const int coff = coffy + v;
-                            double *csum    = &cds->sums->get()   [coff];
-                            double *cweight = &cds->weights->get()[coff];
-                            double *cwmax   = &cds->wmaxs->get()  [coff];
-                            const int xL = -std::min( std::min( Sx, v ), x );
-                            const int xR =  std::min( std::min( Sx, widthm1 - v ), widthm1 - x );
-                            const pixel *s1 = s1_saved + v;
-                            const pixel *s2 = s2_saved;
-                            const double *gwT = gw_saved;
-                            double diff = 0.0, gweights = 0.0;
-                            for( int j = yT; j <= yB; ++j )
-                            {
-                                for( int k = xL; k <= xR; ++k )
-                                {
-                                    diff     += ssd ? GetSSD( s1, s2, gwT, k ) : GetSAD( s1, s2, gwT, k );
-                                    gweights += gwT[k];
-                                }
-                                ForwardPointer( s1, pitch );
-                                ForwardPointer( s2, pitch );
-                                gwT += Sxd;
-                            }
-                            const double weight = ssd ? GetSSDWeight( diff, gweights ) : GetSADWeight( diff, gweights );
-                            *dweight += weight;
-                            *dsum    += weight*GetPixelValue( pf1p + v, pf1pl );
-                            if( weight > *dwmax ) *dwmax = weight;
-                            if( cdsa[Azdm1-z] != 1 )
-                            {
-                                *cweight += weight;
-                                *csum    += weight*srcp[x];
-                                if( weight > *cwmax ) *cwmax = weight;
-                            }
-                        }
-                    }
+                    dstp[x] = SkippedValue( pfp, pitch, width, height, x, y, skipp[doff] );
+                    continue;
                 }
+                double *dsum    = &dds->sums   [doff];
+                double *dweight = &dds->weights[doff];
+                double *dwmax   = &dds->wmaxs  [doff];
                 const double wmax = *dwmax <= std::numeric_limits<double>::epsilon() ? 1.0 : *dwmax;
                 *dsum    += wmax*srcp[x];
                 *dweight += wmax;
@@ -386,76 +1278,84 @@ void TNLMeans::GetFrameWZ
             ForwardPointer( srcp, pitch );
         }
     }
-    int j = fc->size - 1;
-    for( int i = 0; i < fc->size; ++i, --j )
-    {
-        int *cdsa = fc->frames[fc->getCachePos( i )]->dsa;
-        if( ddsa[i] == 2 ) ddsa[i] = cdsa[j] = 1;
-    }
 }
 
 template < int ssd, typename pixel >
 void TNLMeans::GetFrameWZB
 (
-    int             n,
-    const int       threadId,
-    const int       peak,
-    VSFrameRef     *dstPF,
-    VSFrameContext *frame_ctx,
-    VSCore         *core,
-    const VSAPI    *vsapi
+    int              n,
+    nlThread        *thread,
+    const int        peak,
+    const nlPicture *dstPF,
+    nlProvider      *provider
 )
 {
-    nlCache *fc       = threads[threadId].fc;
-    double  *sumsb    = threads[threadId].sumsb->get();
-    double  *weightsb = threads[threadId].weightsb->get();
-    double  *gw       = threads[threadId].gw->get();
-    fc->resetCacheStart( n - Az, n + Az );
-    for( int i = n - Az; i <= n + Az; ++i )
+    nlCache *fc       = thread->fc;
+    nlTiles *tiles    = &thread->tiles;
+    const double *hp  = thread->hs;
+    int64_t comparisons = 0;
+    const nlPatchDistance distance = kernels.distance[ssd][sizeof( pixel ) - 1];
+    LoadFrames( fc, n, provider );
+    const uint8_t **pfplut = fc->pfplut;
+    const nlPicture *srcPF = fc->frames[fc->getCachePos( Az )]->pf;
+    uint8_t *skip = skipping ? thread->skip : nullptr;
+    int startz = Az - std::min( n, Az );
+    int stopz  = Az + std::min( vi.numFrames - n - 1, Az );
+    ClampToScene( fc, startz, stopz );
+    int *mvs = thread->mvs;
+    if( me_range )
+        for( int z = startz; z <= stopz; ++z )
+            if( z != Az )
+                EstimateMotion
+                (
+                    reinterpret_cast<const pixel *>(srcPF->rptr[0]),
+                    reinterpret_cast<const pixel *>(fc->frames[fc->getCachePos( z )]->pf->rptr[0]),
+                    dstPF->stride[0],
+                    dstPF->width[0],
+                    dstPF->height[0],
+                    mvs + z * mvw * mvh * 2
+                );
+    for( int plane = 0; plane < vi.format.numPlanes; ++plane )
     {
-        nlFrame *nl = fc->frames[fc->getCachePos( i - n + Az )];
-        if( nl->fnum != i )
-        {
-            vsapi->freeFrame( nl->pf );
-            nl->pf = vsapi->getFrameFilter( mapn( i ), node, frame_ctx );
-            nl->setFNum( i );
-        }
-    }
-    std::unique_ptr< AlignedArrayObject< const pixel *, 16 > > _pfplut( new AlignedArrayObject< const pixel *, 16 >{ fc->size } );
-    const pixel **pfplut = _pfplut.get()->get();
-    const VSFrameRef *srcPF = fc->frames[fc->getCachePos( Az )]->pf;
-    const int startz = Az - std::min( n, Az );
-    const int stopz  = Az + std::min( vi.numFrames - n - 1, Az );
-    for( int plane = 0; plane < vi.format->numPlanes; ++plane )
-    {
-        const pixel *srcp = reinterpret_cast<const pixel *>(vsapi->getReadPtr( srcPF, plane ));
-        const pixel *pf2p = reinterpret_cast<const pixel *>(vsapi->getReadPtr( srcPF, plane ));
-        pixel    *dstp     = reinterpret_cast<pixel *>(vsapi->getWritePtr( dstPF, plane ));
-        const int pitch    = vsapi->getStride     ( dstPF, plane );
-        const int height   = vsapi->getFrameHeight( dstPF, plane );
-        const int width    = vsapi->getFrameWidth ( dstPF, plane );
+        const int shx = plane ? vi.format.subSamplingW : 0;
+        const int shy = plane ? vi.format.subSamplingH : 0;
+        const double hs = hp[plane];
+        const pixel *srcp = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+        const pixel *pf2p = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+        pixel    *dstp     = reinterpret_cast<pixel *>(dstPF->wptr[plane]);
+        const int pitch    = dstPF->stride[plane];
+        const int height   = dstPF->height[plane];
+        const int width    = dstPF->width[plane];
         const int heightm1 = height - 1;
         const int widthm1  = width  - 1;
-        double *sumsb_saved    = sumsb    + Bx;
-        double *weightsb_saved = weightsb + Bx;
+        const uint8_t *skipp = skip ? skip + skip_offset[plane] : nullptr;
         for( int i = 0; i < fc->size; ++i )
-            pfplut[i] = reinterpret_cast<const pixel *>(vsapi->getReadPtr( fc->frames[fc->getCachePos( i )]->pf, plane ));
-        for( int y = By; y < height + By; y += Byd )
+            pfplut[i] = fc->frames[fc->getCachePos( i )]->pf->rptr[plane];
+        for( int y = By, by = 0; y < height + By; y += Byd, ++by )
         {
-            const int starty = std::max( y - Ay, By );
-            const int stopy  = std::min( y + Ay, heightm1 - std::min( By, heightm1 - y ) );
             const int yTr    = std::min( Byd, height - y + By );
-            for( int x = Bx; x < width + Bx; x += Bxd )
+            for( int r = by ? tiles->rows / 2 : 0; r <= tiles->rows / 2; ++r )
+                tiles->clear_row( by + r );
+            for( int x = Bx, bx = 0; x < width + Bx; x += Bxd, ++bx )
             {
-                fill_zero_d( sumsb,    Bxa );
-                fill_zero_d( weightsb, Bxa );
-                double wmax = 0.0;
-                const int startx = std::max( x - Ax, Bx );
-                const int stopx  = std::min( x + Ax, widthm1 - std::min( Bx, widthm1 - x ) );
                 const int xTr    = std::min( Bxd,  width - x + Bx );
+                if( skipp && SkipBlock( skipp, pf2p, dstp + x - Bx, pitch, width, height, x - Bx, y - By, xTr, yTr ) )
+                    continue;
+                double *sumsb    = tiles->get( bx, by );
+                double *weightsb = sumsb + Bxa;
+                double  wmax     = weightsb[Bxa];
+                weightsb[Bxa + 1] = 1.0;
+                const pixel *sbp_own = GetPixel( pf2p + x, (y-By)*pitch );
                 for( int z = startz; z <= stopz; ++z )
                 {
-                    const pixel *pf1p = pfplut[z];
+                    int dx, dy;
+                    GetMotion( (me_range && z != Az) ? mvs + z * mvw * mvh * 2 : nullptr,
+                               std::min( x, widthm1 ), std::min( y, heightm1 ), shx, shy, dx, dy );
+                    const int starty = std::max( y + dy - Ay, By );
+                    const int stopy  = std::min( y + dy + Ay, heightm1 - std::min( By, heightm1 - y ) );
+                    const int startx = std::max( x + dx - Ax, Bx );
+                    const int stopx  = std::min( x + dx + Ax, widthm1 - std::min( Bx, widthm1 - x ) );
+                    const pixel *pf1p = reinterpret_cast<const pixel *>(pfplut[z]);
                     for( int u = starty; u <= stopy; ++u )
                     {
                         const int yT  = -std::min( std::min( Sy, u ), y );
@@ -469,40 +1369,23 @@ void TNLMeans::GetFrameWZB
                         for( int v = startx; v <= stopx; ++v )
                         {
                             if( z == Az && u == y && v == x ) continue;
+                            const int pair = z == Az ? PairedBlock( x, y, v, u, widthm1, heightm1 ) : 0;
+                            double *paired = pair ? tiles->get( (v - Bx) / Bxd, (u - By) / Byd ) : nullptr;
+                            if( pair < 0 && paired[Bxa * 2 + 1] != 0.0 ) continue;
                             const int xL = -std::min( std::min( Sx, v ), x );
                             const int xR =  std::min( std::min( Sx, widthm1 - v ), widthm1 - x );
-                            const pixel *s1 = s1_saved + v;
-                            const pixel *s2 = s2_saved;
-                            const double *gwT = gw_saved;
-                            double diff = 0.0, gweights = 0.0;
-                            for( int j = yT; j <= yB; ++j )
-                            {
-                                for( int k = xL; k <= xR; ++k )
-                                {
-                                    diff     += ssd ? GetSSD( s1, s2, gwT, k ) : GetSAD( s1, s2, gwT, k );
-                                    gweights += gwT[k];
-                                }
-                                ForwardPointer( s1, pitch );
-                                ForwardPointer( s2, pitch );
-                                gwT += Sxd;
-                            }
-                            const double weight = ssd ? GetSSDWeight( diff, gweights ) : GetSADWeight( diff, gweights );
+                            double gweights = 0.0;
+                            const double diff = PatchDistance< ssd >( distance, s1_saved + v, s2_saved, pitch, gw_saved, xL, xR, yT, yB, gweights );
+                            const double weight = ssd ? GetSSDWeight( diff, gweights, hs ) : GetSADWeight( diff, gweights, hs );
+                            ++comparisons;
                             const int xRb = std::min( std::min( Bx, widthm1 - v ), widthm1 - x );
-                            const pixel *sbp = sbp_saved + v;
-                            double *sumsbT    = sumsb_saved;
-                            double *weightsbT = weightsb_saved;
-                            for( int j = -By; j <= yBb; ++j )
+                            AccumulateBlock( sbp_saved + v, pitch, weight, yBb, xRb, sumsb + Bx, weightsb + Bx );
+                            if( weight > wmax ) wmax = weight;
+                            if( pair > 0 )
                             {
-                                for( int k = -Bx; k <= xRb; ++k )
-                                {
-                                    sumsbT   [k] += sbp[k]*weight;
-                                    weightsbT[k] += weight;
-                                }
-                                ForwardPointer( sbp, pitch );
-                                sumsbT    += Bxd;
-                                weightsbT += Bxd;
+                                AccumulateBlock( sbp_own, pitch, weight, yBb, xRb, paired + Bx, paired + Bxa + Bx );
+                                if( weight > paired[Bxa * 2] ) paired[Bxa * 2] = weight;
                             }
-                            if( weight > wmax ) wmax = weight;
                         }
                     }
                 }
@@ -530,82 +1413,131 @@ void TNLMeans::GetFrameWZB
             ForwardPointer( srcp, pitch*Byd );
         }
     }
+    thread->comparisons += comparisons;
+}
+
+template < int ssd, typename pixel >
+void TNLMeans::SumColumns
+(
+    const pixel  *pfp,
+    const int     pitch,
+    const int     c,
+    const int     y,
+    const int     stopy,
+    const int     yT,
+    const int     widthm1,
+    const int     heightm1,
+    const double *gwy,
+    double       *cols
+)
+{
+    /* For each search offset of the pixels of row y, the column c of their patches
+     * against the column c + dv of the patches of row u, weighted by the rows of gw,
+     * into slot c % Sxd of the ring of row u in cols. The ring holds the last Sxd
+     * columns for the offsets dv = -Ax .. Ax side by side, enough for a patch of
+     * any pixel, and a strip of the offsets is one column wide. */
+    const nlStripDistance strip = kernels.strip[ssd][sizeof( pixel ) - 1];
+    const int slot = c % Sxd;
+    const pixel  *s2        = GetPixel( pfp + c, (y + yT) * pitch );
+    const double *gwy_saved = gwy + yT * Sxd;
+    for( int u = y; u <= stopy; ++u )
+    {
+        const int yB  = std::min( Sy, heightm1 - u );
+        const int dvL = std::max( u == y ? 1 : -Ax, -c );
+        const int dvR = std::min( Ax, widthm1 - c );
+        const pixel *s1 = GetPixel( pfp + c, (u + yT) * pitch );
+        double *col = cols + ((u - y) * Sxd + slot) * Axd + Ax;
+        if( dvL <= dvR )
+            StripDistance< ssd >( strip, s1 + dvL, s2, pitch, gwy_saved, 0, 0, yT, yB, dvR - dvL + 1, col + dvL );
+    }
 }
 
 template < int ssd, typename pixel >
 void TNLMeans::GetFrameWOZ
 (
-    int             n,
-    const int       threadId,
-    const int       peak,
-    VSFrameRef     *dstPF,
-    VSFrameContext *frame_ctx,
-    VSCore         *core,
-    const VSAPI    *vsapi
+    int              n,
+    nlThread        *thread,
+    const int        peak,
+    const nlPicture *dstPF,
+    nlProvider      *provider
 )
 {
-    const VSFrameRef *srcPF = vsapi->getFrameFilter( mapn( n ), node, frame_ctx );
-    SDATA  *ds = threads[threadId].ds;
-    double *gw = threads[threadId].gw->get();
-    for( int plane = 0; plane < vi.format->numPlanes; ++plane )
-    {
-        const pixel *srcp = reinterpret_cast<const pixel *>(vsapi->getReadPtr( srcPF, plane ));
-        const pixel *pfp  = reinterpret_cast<const pixel *>(vsapi->getReadPtr( srcPF, plane ));
-        pixel    *dstp     = reinterpret_cast<pixel *>(vsapi->getWritePtr( dstPF, plane ));
-        const int pitch    = vsapi->getStride     ( dstPF, plane );
-        const int height   = vsapi->getFrameHeight( dstPF, plane );
-        const int width    = vsapi->getFrameWidth ( dstPF, plane );
+    nlPictureRef unique_src( provider->fetch( mapn( n ), false ) );
+    const nlPicture *srcPF  = unique_src.get();
+    const nlPicture *prevPF = thread->prev;
+    SDATA  *ds = thread->ds;
+    double *dists = thread->dists;
+    double *vsums = thread->vsums;
+    double *cols  = thread->cols;
+    const double *hp = thread->hs;
+    /* Without blocks gw is the outer product of its centre row and column. */
+    const double *gwx = gw + Sy * Sxd + Sx;
+    const double *gwy = gwx;
+    int64_t comparisons = 0;
+    uint8_t *skip = skipping ? thread->skip : nullptr;
+    for( int plane = 0; plane < vi.format.numPlanes; ++plane )
+    {
+        const uint8_t *skipp = skip ? skip + skip_offset[plane] : nullptr;
+        const double   hs    = hp[plane];
+        const pixel *srcp = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+        const pixel *pfp  = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+        pixel    *dstp     = reinterpret_cast<pixel *>(dstPF->wptr[plane]);
+        const int pitch    = dstPF->stride[plane];
+        const int height   = dstPF->height[plane];
+        const int width    = dstPF->width[plane];
         const int heightm1 = height - 1;
         const int widthm1  = width  - 1;
-        fill_zero_d( ds->sums->get(),    height * width );
-        fill_zero_d( ds->weights->get(), height * width );
-        fill_zero_d( ds->wmaxs->get(),   height * width );
+        ds->cleared = 0;
+        /* In the recursive mode the previous output is searched first, so its
+         * weights are in place before each pixel is finished below. */
+        if( prevPF )
+            comparisons += CompareFrames< ssd >( pfp, reinterpret_cast<const pixel *>(prevPF->rptr[plane]),
+                                                 pitch, width, height, gw, dists, vsums, ds, nullptr, nullptr, 0, 0, skipp, hp[plane] );
         for( int y = 0; y < height; ++y )
         {
             const int stopy = std::min( y + Ay, heightm1 );
             const int doffy = y * width;
+            const int yT    = -std::min( Sy, y );
+            clear_rows_d( ds, stopy, width );
             for( int x = 0; x < width; ++x )
             {
+                for( int c = x ? x + Sx : 0; c <= std::min( x + Sx, widthm1 ); ++c )
+                    SumColumns< ssd >( pfp, pitch, c, y, stopy, yT, widthm1, heightm1, gwy, cols );
                 const int startxt = std::max( x - Ax, 0 );
                 const int stopx   = std::min( x + Ax, widthm1 );
                 const int doff = doffy + x;
-                double *dsum    = &ds->sums->get()   [doff];
-                double *dweight = &ds->weights->get()[doff];
-                double *dwmax   = &ds->wmaxs->get()  [doff];
+                double *dsum    = &ds->sums   [doff];
+                double *dweight = &ds->weights[doff];
+                double *dwmax   = &ds->wmaxs  [doff];
+                const bool dskip = skipp && skipp[doff];
                 for( int u = y; u <= stopy; ++u )
                 {
                     const int startx = u == y ? x+1 : startxt;
-                    const int yT = -std::min( std::min( Sy, u ), y );
-                    const int yB =  std::min( std::min( Sy, heightm1 - u ), heightm1 - y );
-                    const pixel *s1_saved = GetPixel( pfp,     (u+yT)*pitch );
-                    const pixel *s2_saved = GetPixel( pfp + x, (y+yT)*pitch );
-                    const double *gw_saved = gw+(yT+Sy)*Sxd+Sx;
+                    const int yB = std::min( Sy, heightm1 - u );
+                    double gwys = 0.0;
+                    for( int j = yT; j <= yB; ++j )
+                        gwys += gwy[j * Sxd];
+                    const int colo = (u - y) * Sxd * Axd + Ax - x;
                     const int pfpl  = u * pitch;
                     const int coffy = u * width;
                     for( int v = startx; v <= stopx; ++v )
                     {
                         const int coff = coffy+v;
-                        double *csum    = &ds->sums->get()   [coff];
-                        double *cweight = &ds->weights->get()[coff];
-                        double *cwmax   = &ds->wmaxs->get()  [coff];
+                        if( dskip && skipp[coff] ) continue;
+                        double *csum    = &ds->sums   [coff];
+                        double *cweight = &ds->weights[coff];
+                        double *cwmax   = &ds->wmaxs  [coff];
                         const int xL = -std::min( std::min( Sx, v ), x );
                         const int xR =  std::min( std::min( Sx, widthm1 - v ), widthm1 - x );
-                        const pixel *s1 = s1_saved + v;
-                        const pixel *s2 = s2_saved;
-                        const double *gwT = gw_saved;
-                        double diff = 0.0, gweights = 0.0;
-                        for( int j = yT; j <= yB; ++j )
+                        double diff = 0.0, gwxs = 0.0;
+                        for( int k = xL, slot = (x + xL) % Sxd; k <= xR; ++k, slot = slot == Sxd - 1 ? 0 : slot + 1 )
                         {
-                            for( int k = xL; k <= xR; ++k )
-                            {
-                                diff     += ssd ? GetSSD( s1, s2, gwT, k ) : GetSAD( s1, s2, gwT, k );
-                                gweights += gwT[k];
-                            }
-                            ForwardPointer( s1, pitch );
-                            ForwardPointer( s2, pitch );
-                            gwT += Sxd;
+                            diff += gwx[k] * cols[colo + slot * Axd + v];
+                            gwxs += gwx[k];
                         }
-                        const double weight = ssd ? GetSSDWeight( diff, gweights ) : GetSADWeight( diff, gweights );
+                        const double gweights = gwxs * gwys;
+                        const double weight = ssd ? GetSSDWeight( diff, gweights, hs ) : GetSADWeight( diff, gweights, hs );
+                        ++comparisons;
                         *cweight += weight;
                         *dweight += weight;
                         *csum += weight * srcp[x];
@@ -614,6 +1546,11 @@ void TNLMeans::GetFrameWOZ
                         if( weight > *dwmax ) *dwmax = weight;
                     }
                 }
+                if( dskip )
+                {
+                    dstp[x] = SkippedValue( pfp, pitch, width, height, x, y, skipp[doff] );
+                    continue;
+                }
                 const double wmax = *dwmax <= std::numeric_limits<double>::epsilon() ? 1.0 : *dwmax;
                 *dsum    += wmax*srcp[x];
                 *dweight += wmax;
@@ -623,50 +1560,57 @@ void TNLMeans::GetFrameWOZ
             ForwardPointer( srcp, pitch );
         }
     }
-    vsapi->freeFrame( srcPF );
+    thread->comparisons += comparisons;
 }
 
 template < int ssd, typename pixel >
 void TNLMeans::GetFrameWOZB
 (
-    int             n,
-    const int       threadId,
-    const int       peak,
-    VSFrameRef     *dstPF,
-    VSFrameContext *frame_ctx,
-    VSCore         *core,
-    const VSAPI    *vsapi
+    int              n,
+    nlThread        *thread,
+    const int        peak,
+    const nlPicture *dstPF,
+    nlProvider      *provider
 )
 {
-    const VSFrameRef *srcPF = vsapi->getFrameFilter( mapn( n ), node, frame_ctx );
-    double *sumsb    = threads[threadId].sumsb->get();
-    double *weightsb = threads[threadId].weightsb->get();
-    double *gw       = threads[threadId].gw->get();
-    for( int plane = 0; plane < vi.format->numPlanes; ++plane )
-    {
-        const pixel *srcp = reinterpret_cast<const pixel *>(vsapi->getReadPtr( srcPF, plane ));
-        const pixel *pfp  = reinterpret_cast<const pixel *>(vsapi->getReadPtr( srcPF, plane ));
-        pixel    *dstp     = reinterpret_cast<pixel *>(vsapi->getWritePtr( dstPF, plane ));
-        const int pitch    = vsapi->getStride     ( dstPF, plane );
-        const int height   = vsapi->getFrameHeight( dstPF, plane );
-        const int width    = vsapi->getFrameWidth ( dstPF, plane );
+    nlPictureRef unique_src( provider->fetch( mapn( n ), false ) );
+    const nlPicture *srcPF = unique_src.get();
+    nlTiles *tiles   = &thread->tiles;
+    const double *hp = thread->hs;
+    int64_t comparisons = 0;
+    const nlPatchDistance distance = kernels.distance[ssd][sizeof( pixel ) - 1];
+    uint8_t *skip = skipping ? thread->skip : nullptr;
+    for( int plane = 0; plane < vi.format.numPlanes; ++plane )
+    {
+        const uint8_t *skipp = skip ? skip + skip_offset[plane] : nullptr;
+        const double   hs    = hp[plane];
+        const pixel *srcp = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+        const pixel *pfp  = reinterpret_cast<const pixel *>(srcPF->rptr[plane]);
+        pixel    *dstp     = reinterpret_cast<pixel *>(dstPF->wptr[plane]);
+        const int pitch    = dstPF->stride[plane];
+        const int height   = dstPF->height[plane];
+        const int width    = dstPF->width[plane];
         const int heightm1 = height - 1;
         const int widthm1  = width  - 1;
-        double *sumsb_saved    = sumsb    + Bx;
-        double *weightsb_saved = weightsb + Bx;
-        for( int y = By; y < height + By; y += Byd )
+        for( int y = By, by = 0; y < height + By; y += Byd, ++by )
         {
             const int starty = std::max( y - Ay, By );
             const int stopy  = std::min( y + Ay, heightm1 - std::min( By, heightm1 - y ) );
             const int yTr    = std::min( Byd, height - y + By );
-            for( int x = Bx; x < width + Bx; x += Bxd )
+            for( int r = by ? tiles->rows / 2 : 0; r <= tiles->rows / 2; ++r )
+                tiles->clear_row( by + r );
+            for( int x = Bx, bx = 0; x < width + Bx; x += Bxd, ++bx )
             {
-                fill_zero_d( sumsb,    Bxa );
-                fill_zero_d( weightsb, Bxa );
-                double wmax = 0.0;
+                const int xTr    = std::min( Bxd, width - x + Bx );
+                if( skipp && SkipBlock( skipp, pfp, dstp + x - Bx, pitch, width, height, x - Bx, y - By, xTr, yTr ) )
+                    continue;
+                double *sumsb    = tiles->get( bx, by );
+                double *weightsb = sumsb + Bxa;
+                double  wmax     = weightsb[Bxa];
+                weightsb[Bxa + 1] = 1.0;
+                const pixel *sbp_own = GetPixel( pfp + x, (y-By)*pitch );
                 const int startx = std::max( x - Ax, Bx );
                 const int stopx  = std::min( x + Ax, widthm1 - std::min( Bx, widthm1 - x ) );
-                const int xTr    = std::min( Bxd, width - x + Bx );
                 for( int u = starty; u <= stopy; ++u )
                 {
                     const int yT  = -std::min( std::min( Sy, u ), y );
@@ -679,40 +1623,23 @@ void TNLMeans::GetFrameWOZB
                     for( int v = startx; v <= stopx; ++v )
                     {
                         if (u == y && v == x) continue;
+                        const int pair = PairedBlock( x, y, v, u, widthm1, heightm1 );
+                        double *paired = pair ? tiles->get( (v - Bx) / Bxd, (u - By) / Byd ) : nullptr;
+                        if( pair < 0 && paired[Bxa * 2 + 1] != 0.0 ) continue;
                         const int xL = -std::min( std::min( Sx, v ), x );
                         const int xR =  std::min( std::min( Sx, widthm1 - v ), widthm1 - x );
-                        const pixel *s1 = s1_saved + v;
-                        const pixel *s2 = s2_saved;
-                        const double *gwT = gw_saved;
-                        double diff = 0.0, gweights = 0.0;
-                        for( int j = yT; j <= yB; ++j )
-                        {
-                            for( int k = xL; k <= xR; ++k )
-                            {
-                                diff     += ssd ? GetSSD( s1, s2, gwT, k ) : GetSAD( s1, s2, gwT, k );
-                                gweights += gwT[k];
-                            }
-                            ForwardPointer( s1, pitch );
-                            ForwardPointer( s2, pitch );
-                            gwT += Sxd;
-                        }
-                        const double weight = ssd ? GetSSDWeight( diff, gweights ) : GetSADWeight( diff, gweights );
+                        double gweights = 0.0;
+                        const double diff = PatchDistance< ssd >( distance, s1_saved + v, s2_saved, pitch, gw_saved, xL, xR, yT, yB, gweights );
+                        const double weight = ssd ? GetSSDWeight( diff, gweights, hs ) : GetSADWeight( diff, gweights, hs );
+                        ++comparisons;
                         const int xRb = std::min( std::min( Bx, widthm1 - v ), widthm1 - x );
-                        const pixel *sbp = sbp_saved + v;
-                        double *sumsbT    = sumsb_saved;
-                        double *weightsbT = weightsb_saved;
-                        for( int j = -By; j <= yBb; ++j )
+                        AccumulateBlock( sbp_saved + v, pitch, weight, yBb, xRb, sumsb + Bx, weightsb + Bx );
+                        if( weight > wmax ) wmax = weight;
+                        if( pair > 0 )
                         {
-                            for( int k = -Bx; k <= xRb; ++k )
-                            {
-                                sumsbT   [k] += sbp[k]*weight;
-                                weightsbT[k] += weight;
-                            }
-                            sumsbT    += Bxd;
-                            weightsbT += Bxd;
-                            ForwardPointer( sbp, pitch );
+                            AccumulateBlock( sbp_own, pitch, weight, yBb, xRb, paired + Bx, paired + Bxa + Bx );
+                            if( weight > paired[Bxa * 2] ) paired[Bxa * 2] = weight;
                         }
-                        if( weight > wmax ) wmax = weight;
                     }
                 }
                 const pixel *srcpT = srcp + x - Bx;
@@ -739,7 +1666,7 @@ void TNLMeans::GetFrameWOZB
             ForwardPointer( srcp, pitch*Byd );
         }
     }
-    vsapi->freeFrame( srcPF );
+    thread->comparisons += comparisons;
 }
 
 int TNLMeans::mapn( int n )
@@ -749,32 +1676,23 @@ int TNLMeans::mapn( int n )
     return n;
 }
 
-nlFrame::nlFrame( bool _useblocks, int _size, const VSVideoInfo &vi, const VSAPI *_vsapi )
+nlFrame::nlFrame( bool _accumulate, const nlVideoInfo &vi )
 {
-    vsapi = _vsapi;
-    fnum = -20;
-    pf   = nullptr;
-    ds   = nullptr;
-    dsa  = nullptr;
-    if( !_useblocks )
+    fnum  = -20;
+    pf    = nullptr;
+    ds    = nullptr;
+    dsa   = nullptr;
+    users = 0;
+    owned = false;
+    planes = vi.format.numPlanes;
+    if( _accumulate )
     {
         try
         {
-            ds = new SDATA * [3];
-            std::memset( ds, 0, 3 * sizeof(SDATA *) );
-            for( int i = 0; i < vi.format->numPlanes; ++i )
-            {
-                const int width  = vi.width  >> (i ? vi.format->subSamplingW : 0);
-                const int height = vi.height >> (i ? vi.format->subSamplingH : 0);
-                const size_t mem_size = width * height * sizeof(double);
+            ds = new SDATA * [planes];
+            std::memset( ds, 0, planes * sizeof(SDATA *) );
+            for( int i = 0; i < planes; ++i )
                 ds[i] = new SDATA();
-                ds[i]->sums    = new AlignedArrayObject< double, 16 >{ mem_size };
-                ds[i]->weights = new AlignedArrayObject< double, 16 >{ mem_size };
-                ds[i]->wmaxs   = new AlignedArrayObject< double, 16 >{ mem_size };
-            }
-            dsa = new int[_size];
-            for( int i = 0; i < _size; ++i )
-                dsa[i] = 0;
         }
         catch( ... )
         {
@@ -784,6 +1702,24 @@ nlFrame::nlFrame( bool _useblocks, int _size, const VSVideoInfo &vi, const VSAPI
     }
 }
 
+void nlFrame::place( AlignedArena &arena, int _size, const nlVideoInfo &vi )
+{
+    if( ds == nullptr )
+        return;
+    for( int i = 0; i < planes; ++i )
+    {
+        const int width  = vi.width  >> (i ? vi.format.subSamplingW : 0);
+        const int height = vi.height >> (i ? vi.format.subSamplingH : 0);
+        ds[i]->sums    = arena.take< double >( width * height );
+        ds[i]->weights = arena.take< double >( width * height );
+        ds[i]->wmaxs   = arena.take< double >( width * height );
+        ds[i]->width   = width;
+        ds[i]->height  = height;
+        ds[i]->cleared = 0;
+    }
+    dsa = arena.take< int >( _size );
+}
+
 nlFrame::~nlFrame()
 {
     clean();
@@ -797,26 +1733,22 @@ void nlFrame::setFNum( int i )
 void nlFrame::clean()
 {
     if( pf )
-        vsapi->freeFrame( pf );
+        pf->release();
     if( ds )
     {
-        for( int i = 0; i < 3; ++i )
+        for( int i = 0; i < planes; ++i )
             if( ds[i] )
-            {
-                delete ds[i]->sums;
-                delete ds[i]->weights;
-                delete ds[i]->wmaxs;
                 delete ds[i];
-            }
         delete [] ds;
     }
-    if( dsa )
-        delete [] dsa;
 }
 
-nlCache::nlCache( int _size, bool _useblocks, const VSVideoInfo &vi, const VSAPI *vsapi )
+nlCache::nlCache( int _size, const nlVideoInfo &vi )
 {
-    frames = nullptr;
+    frames   = nullptr;
+    pfplut   = nullptr;
+    partners = nullptr;
+    plan     = nullptr;
     start_pos = size = -20;
     if( _size > 0 )
     {
@@ -827,7 +1759,7 @@ nlCache::nlCache( int _size, bool _useblocks, const VSVideoInfo &vi, const VSAPI
             frames = new nlFrame * [size];
             std::memset( frames, 0, size * sizeof(nlFrame *) );
             for( int i = 0; i < size; ++i )
-                frames[i] = new nlFrame( _useblocks, _size, vi, vsapi );
+                frames[i] = new nlFrame( false, vi );
         }
         catch( ... )
         {
@@ -842,6 +1774,13 @@ nlCache::~nlCache()
     clean();
 }
 
+void nlCache::place( AlignedArena &arena )
+{
+    pfplut   = arena.take< const uint8_t * >( size );
+    partners = arena.take<       nlFrame * >( size );
+    plan     = arena.take<       int       >( size );
+}
+
 void nlCache::resetCacheStart( int first, int last )
 {
     for( int j = first; j <= last; ++j )
@@ -857,29 +1796,261 @@ void nlCache::resetCacheStart( int first, int last )
             }
 }
 
-void nlCache::clearDS( nlFrame *nl )
+int nlCache::getCachePos( int n )
 {
-    for( int i = 0; i < 3; ++i )
-        if( nl->ds[i] )
+    return (start_pos + n) % size;
+}
+
+void nlCache::clean()
+{
+    if( frames )
+    {
+        for( int i = 0; i < size; ++i )
+            if( frames[i] )
+                delete frames[i];
+        delete [] frames;
+    }
+}
+
+nlWindow::nlWindow( int _capacity, int _dsasize, const nlVideoInfo &vi )
+{
+    frames   = nullptr;
+    adding   = nullptr;
+    used     = nullptr;
+    stamp    = 0;
+    capacity = size = _capacity;
+    dsasize  = _dsasize;
+    try
+    {
+        frames = new nlFrame * [capacity];
+        std::memset( frames, 0, capacity * sizeof(nlFrame *) );
+        for( int i = 0; i < capacity; ++i )
+            frames[i] = new nlFrame( true, vi );
+        adding = new std::mutex[capacity];
+    }
+    catch( ... )
+    {
+        clean();
+        throw bad_alloc{};
+    }
+}
+
+nlWindow::~nlWindow()
+{
+    clean();
+}
+
+void nlWindow::place( AlignedArena &arena, const nlVideoInfo &vi )
+{
+    for( int i = 0; i < size; ++i )
+        frames[i]->place( arena, dsasize, vi );
+    used = arena.take< unsigned >( size );
+    if( used )
+        std::fill_n( used, size, 0u );
+}
+
+nlFrame *nlWindow::find( int n )
+{
+    for( int i = 0; i < size; ++i )
+        if( frames[i]->fnum == n )
         {
-            const size_t res = nl->vsapi->getFrameWidth( nl->pf, i ) * nl->vsapi->getFrameHeight( nl->pf, i );
-            fill_zero_d( nl->ds[i]->sums->get(),    res );
-            fill_zero_d( nl->ds[i]->weights->get(), res );
-            fill_zero_d( nl->ds[i]->wmaxs->get(),   res );
+            used[i] = ++stamp;
+            return frames[i];
         }
-    for( int i = 0; i < size; ++i ) nl->dsa[i] = 0;
+    return nullptr;
 }
 
-int nlCache::getCachePos( int n )
+nlFrame *nlWindow::create( int n )
 {
-    return (start_pos + n) % size;
+    /* Take a free entry, or else the least recently used one nobody waits on. */
+    int victim = -1;
+    for( int i = 0; i < size; ++i )
+    {
+        const nlFrame *nl = frames[i];
+        if( nl->owned || nl->users )
+            continue;
+        if( nl->fnum < 0 )
+        {
+            victim = i;
+            break;
+        }
+        if( victim < 0 || used[i] < used[victim] )
+            victim = i;
+    }
+    if( victim < 0 )
+        return nullptr;
+    nlFrame *nl = frames[victim];
+    nl->setFNum( n );
+    for( int i = 0; i < nl->planes; ++i )
+        nl->ds[i]->cleared = 0;
+    for( int i = 0; i < dsasize; ++i )
+        nl->dsa[i] = PAIR_OPEN;
+    used[victim] = ++stamp;
+    return nl;
 }
 
-void nlCache::clean()
+nlFrame *nlWindow::claim
+(
+    int       n,
+    int       Az,
+    int       startz,
+    int       stopz,
+    bool      forward,
+    int      *plan,
+    nlFrame **partners
+)
+{
+    /* Decide which pairs of frame n this thread compares. A pair some other
+     * thread has taken is left to it, and a pair compared here is promised to
+     * the entry of the other frame unless that frame has it already. */
+    std::lock_guard< std::mutex > lock( mtx );
+    nlFrame *cur = find( n );
+    if( cur && cur->owned )
+        cur = nullptr;      /* The same frame is being filtered twice. Keep this one private. */
+    else if( cur == nullptr )
+        cur = create( n );
+    if( cur )
+        cur->owned = true;
+    for( int z = startz; z <= stopz; ++z )
+    {
+        plan    [z] = 0;
+        partners[z] = nullptr;
+        if( z == Az || (cur && cur->dsa[z] != PAIR_OPEN) )
+            continue;
+        plan[z] = 1;
+        if( cur )
+            cur->dsa[z] = PAIR_CLAIMED;
+        const int m = n - Az + z;
+        nlFrame *partner = find( m );
+        if( partner == nullptr && (m > n || !forward) )
+            partner = create( m );
+        if( partner && partner->dsa[Az * 2 - z] == PAIR_OPEN )
+        {
+            partner->dsa[Az * 2 - z] = PAIR_PROMISED;
+            ++partner->users;
+            partners[z] = partner;
+        }
+    }
+    return cur;
+}
+
+void nlWindow::deliver( nlFrame *nl, int z, const nlFrame *acc )
+{
+    /* The entry is not reused while it has users, and its owner reads the sums
+     * only once the pair is done, so only other deliveries to it are kept out. */
+    int e = 0;
+    while( frames[e] != nl )
+        ++e;
+    {
+        std::lock_guard< std::mutex > lock( adding[e] );
+        for( int i = 0; i < nl->planes; ++i )
+            add_ds( nl->ds[i], acc->ds[i] );
+    }
+    {
+        std::lock_guard< std::mutex > lock( mtx );
+        nl->dsa[z] = PAIR_DONE;
+        --nl->users;
+    }
+    delivered.notify_all();
+}
+
+void nlWindow::wait( nlFrame *nl, int startz, int stopz )
+{
+    std::unique_lock< std::mutex > lock( mtx );
+    for( int z = startz; z <= stopz; ++z )
+        delivered.wait( lock, [&]() { return nl->dsa[z] != PAIR_PROMISED; } );
+}
+
+void nlWindow::finish( nlFrame *nl )
+{
+    std::lock_guard< std::mutex > lock( mtx );
+    nl->owned = false;
+    nl->setFNum( -20 );
+}
+
+void nlWindow::clean()
 {
     if( frames )
     {
-        for( int i = 0; i < size; ++i )
+        for( int i = 0; i < capacity; ++i )
+            if( frames[i] )
+                delete frames[i];
+        delete [] frames;
+    }
+    delete [] adding;
+}
+
+nlSource::nlSource( int _capacity, const nlVideoInfo &vi )
+{
+    frames   = nullptr;
+    used     = nullptr;
+    stamp    = 0;
+    capacity = size = _capacity;
+    hits     = 0;
+    misses   = 0;
+    try
+    {
+        frames = new nlFrame * [capacity];
+        std::memset( frames, 0, capacity * sizeof(nlFrame *) );
+        for( int i = 0; i < capacity; ++i )
+            frames[i] = new nlFrame( false, vi );
+    }
+    catch( ... )
+    {
+        clean();
+        throw bad_alloc{};
+    }
+}
+
+nlSource::~nlSource()
+{
+    clean();
+}
+
+void nlSource::place( AlignedArena &arena )
+{
+    used = arena.take< unsigned >( size );
+    if( used )
+        std::fill_n( used, size, 0u );
+}
+
+const nlPicture *nlSource::get( int n )
+{
+    std::lock_guard< std::mutex > lock( mtx );
+    for( int i = 0; i < size; ++i )
+        if( frames[i]->fnum == n )
+        {
+            used[i] = ++stamp;
+            ++hits;
+            return frames[i]->pf->retain();
+        }
+    return nullptr;
+}
+
+void nlSource::put( int n, const nlPicture *pf )
+{
+    std::lock_guard< std::mutex > lock( mtx );
+    int victim = 0;
+    for( int i = 0; i < size; ++i )
+    {
+        if( frames[i]->fnum == n )
+            return;
+        if( used[i] < used[victim] )
+            victim = i;
+    }
+    nlFrame *nl = frames[victim];
+    if( nl->pf )
+        nl->pf->release();
+    nl->pf = pf->retain();
+    nl->setFNum( n );
+    used[victim] = ++stamp;
+}
+
+void nlSource::clean()
+{
+    if( frames )
+    {
+        for( int i = 0; i < capacity; ++i )
             if( frames[i] )
                 delete frames[i];
         delete [] frames;
@@ -889,52 +2060,33 @@ void nlCache::clean()
 nlThread::nlThread()
 {
     active = false;
-    sumsb = weightsb = gw = nullptr;
+    dists = vsums = cols = nullptr;
+    next  = nullptr;
+    arena = nullptr;
+    node  = 0;
     fc = nullptr;
+    own = other = nullptr;
+    mvs = nullptr;
+    prev = maskf = nullptr;
+    skip = nullptr;
+    hist = nullptr;
     ds = nullptr;
+    comparisons = pruned = cache_hits = wait_us = 0;
 }
 nlThread::~nlThread()
 {
+    delete arena;
     if( fc )
         delete fc;
-    if( gw )
-        delete gw;
-    if( sumsb )
-        delete sumsb;
-    if( weightsb )
-        delete weightsb;
+    if( own )
+        delete own;
+    if( other )
+        delete other;
     if( ds )
-    {
-        delete ds->sums;
-        delete ds->weights;
-        delete ds->wmaxs;
         delete ds;
-    }
-}
-
-ActiveThread::ActiveThread
-(
-    nlThread * &threads,
-    int        &numThreads,
-    std::mutex &mtx
-) : id( -1 ), thread( nullptr )
-{
-    do
-    {
-        std::lock_guard< std::mutex > lock( mtx );
-        for( int i = 0; i < numThreads; ++i )
-            if( threads[i].active == false )
-            {
-                id     = i;
-                thread = &threads[i];
-                thread->active = true;
-                break;
-            }
-    } while( id == -1 );
 }
 
 ActiveThread::~ActiveThread()
 {
-    if( thread )
-        thread->active = false;
+    filter->ReleaseThread( thread );
 }
@@ -24,20 +24,30 @@
 */
 
 #include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <algorithm>
+#include <memory>
+#include <new>
 #include <limits>
 #include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
 
 #ifdef __MINGW32__
+#include <mutex>
 #include "mingw.thread.h"
 #include "mingw.mutex.h"
+#include "mingw.condition_variable.h"
 #else
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #endif
 
 #include "AlignedMemory.h"
+#include "Kernels.h"
 
 class CustomException
 {
@@ -49,24 +59,112 @@ public:
     const char * what() const noexcept { return name.c_str(); }
 };
 
+/* Format and dimensions of the clip as far as the filter needs them. The
+ * filter itself does not depend on VapourSynth; the plugin, or any other
+ * host, describes its clip with these and hands frames over as nlPicture. */
+struct nlFormat
+{
+    int numPlanes;
+    int bitsPerSample;
+    int bytesPerSample;
+    int subSamplingW;       /* of planes 1 and 2 */
+    int subSamplingH;
+};
+
+struct nlVideoInfo
+{
+    nlFormat format;
+    int      width;
+    int      height;
+    int      numFrames;
+};
+
+/* A frame of the host: plane pointers, strides in bytes and dimensions per
+ * plane, and whether a scene change lies before or after it. Pictures are
+ * reference counted; the host derives from this class to hold on to its own
+ * frame and gives it back in the destructor. Only output pictures have
+ * write pointers. */
+class nlPicture
+{
+private:
+    mutable std::atomic< int > refs;
+public:
+    const uint8_t *rptr  [3];
+    uint8_t       *wptr  [3];
+    int            stride[3];
+    int            width [3];
+    int            height[3];
+    bool           cut_prev;
+    bool           cut_next;
+    nlPicture() : refs( 1 ), rptr(), wptr(), stride(), width(), height(), cut_prev( false ), cut_next( false ) {}
+    virtual ~nlPicture() {}
+    const nlPicture *retain() const { ++refs; return this; }
+    void release() const { if( --refs == 0 ) delete this; }
+};
+
+struct nlRelease
+{
+    void operator()( const nlPicture *p ) const { if( p ) p->release(); }
+};
+typedef std::unique_ptr< const nlPicture, nlRelease > nlPictureRef;
+
+/* Frames of the input clip, and of the mask clip if there is one, as the
+ * filter needs them while producing a frame. fetch returns a new reference
+ * or nullptr on failure; request announces frames that will be fetched.
+ * prefetch asks for a frame of the clip that is likely needed soon, without
+ * waiting for it or holding back the current frame; a provider that can fetch
+ * it in the background hands it over through TNLMeans::PutFrame. */
+class nlProvider
+{
+public:
+    virtual ~nlProvider() {}
+    virtual const nlPicture *fetch   ( int n, bool mask ) = 0;
+    virtual void             request ( int, bool ) {}
+    virtual void             prefetch( int ) {}
+};
+
+/* What the filter reports about a frame it produced. */
+struct nlReport
+{
+    const char *engine;
+    double      sigma[3];       /* estimated noise and h per plane, with hauto */
+    double      h    [3];
+    int64_t     time_us;
+    int64_t     comparisons;
+    int64_t     pruned;
+    int64_t     cache_hits;
+    int64_t     wait_us;
+    int64_t     source_hits;    /* totals since the filter was created, az > 0 only */
+    int64_t     source_misses;
+    const char *simd;           /* name of the kernels in use */
+    int         slots;
+    size_t      footprint;
+};
+
 struct SDATA
 {
-    AlignedArrayObject< double, 16 > *weights;
-    AlignedArrayObject< double, 16 > *sums;
-    AlignedArrayObject< double, 16 > *wmaxs;
+    double *weights;
+    double *sums;
+    double *wmaxs;
+    int     width;
+    int     height;
+    int     cleared;    /* rows zeroed since the accumulators were last reset */
 };
 
 class nlFrame
 {
 public:
     int               fnum;
-    const VSAPI      *vsapi;
-    const VSFrameRef *pf;
+    const nlPicture  *pf;
     SDATA           **ds;
+    int               planes;
     int              *dsa;
+    int               users;
+    bool              owned;
     typedef class {} bad_alloc;
-    nlFrame( bool _useblocks, int _size, const VSVideoInfo &vi, const VSAPI *_vsapi );
+    nlFrame( bool _accumulate, const nlVideoInfo &vi );
     ~nlFrame();
+    void place( AlignedArena &arena, int _size, const nlVideoInfo &vi );
     void setFNum( int i );
     void clean();
 };
@@ -76,41 +174,133 @@ class nlCache
 public:
     nlFrame **frames;
     int start_pos, size;
+    const uint8_t **pfplut;
+    nlFrame       **partners;
+    int            *plan;
     typedef class {} bad_alloc;
-    nlCache( int _size, bool _useblocks, const VSVideoInfo &vi, const VSAPI *vsapi );
+    nlCache( int _size, const nlVideoInfo &vi );
     ~nlCache();
+    void place( AlignedArena &arena );
     void resetCacheStart( int first, int last );
     int  getCachePos    ( int n );
-    void clearDS        ( nlFrame *nl );
     void clean();
 };
 
+/* Accumulators of frames shared by all threads in the temporal pixel mode.
+ * The weight of a pixel pair is symmetric, so each pair of frames is compared
+ * once and its contributions are delivered to both frames, whichever thread
+ * filters them. dsa[z] of an entry holds the state of the pair with the frame
+ * at the relative position z - Az. mtx guards the states and the entries;
+ * the accumulators of an entry are added under a lock of its own, so threads
+ * delivering to different frames do not wait for each other. */
+class nlWindow
+{
+private:
+    nlFrame  **frames;
+    std::mutex *adding;     /* per entry, held while accumulators are added */
+    int        capacity;
+    int        dsasize;
+    unsigned   stamp;
+    unsigned  *used;
+    std::mutex mtx;
+    std::condition_variable delivered;
+    nlFrame *find  ( int n );
+    nlFrame *create( int n );
+public:
+    enum { PAIR_OPEN = 0, PAIR_DONE, PAIR_CLAIMED, PAIR_PROMISED };
+    int size;
+    typedef class {} bad_alloc;
+    nlWindow( int _capacity, int _dsasize, const nlVideoInfo &vi );
+    ~nlWindow();
+    void     place  ( AlignedArena &arena, const nlVideoInfo &vi );
+    nlFrame *claim  ( int n, int Az, int startz, int stopz, bool forward, int *plan, nlFrame **partners );
+    void     deliver( nlFrame *nl, int z, const nlFrame *acc );
+    void     wait   ( nlFrame *nl, int startz, int stopz );
+    void     finish ( nlFrame *nl );
+    void clean();
+};
+
+/* Source frames referenced across calls and shared by all threads. With
+ * linear access, the frame after the temporal window of the current frame is
+ * prefetched and kept here for the next frame. */
+class nlSource
+{
+private:
+    nlFrame  **frames;
+    int        capacity;
+    unsigned   stamp;
+    unsigned  *used;
+    std::mutex mtx;
+public:
+    int size;
+    std::atomic< int64_t > hits;
+    std::atomic< int64_t > misses;
+    typedef class {} bad_alloc;
+    nlSource( int _capacity, const nlVideoInfo &vi );
+    ~nlSource();
+    void place( AlignedArena &arena );
+    const nlPicture *get( int n );
+    void             put( int n, const nlPicture *pf );
+    void clean();
+};
+
+/* Accumulators of the blocks of a plane in the block modes, over the block rows
+ * a search window reaches before and after the current one. A block compared
+ * with the centre of a later block hands that block its weight too, so the
+ * accumulators of a block hold sums[Bxa], weights[Bxa], wmax, and whether the
+ * block was filtered, which tells the later block that the pair is done. */
+class nlTiles
+{
+public:
+    double *acc;
+    int     stride;     /* doubles per block */
+    int     columns;    /* blocks per row */
+    int     rows;       /* block rows held, as a ring */
+    nlTiles() : acc( nullptr ), stride( 0 ), columns( 0 ), rows( 0 ) {}
+    double *get( int bx, int by ) { return acc + (static_cast<size_t>(by % rows) * columns + bx) * stride; }
+    void clear_row( int by ) { std::fill_n( get( 0, by ), static_cast<size_t>(columns) * stride, 0.0 ); }
+};
+
 class nlThread
 {
 public:
-    bool active;
-    AlignedArrayObject< double, 16 > *sumsb;
-    AlignedArrayObject< double, 16 > *weightsb;
-    AlignedArrayObject< double, 16 > *gw;
+    std::atomic< bool > active;
+    nlThread *next;         /* slots created after the constructor, as a list */
+    AlignedArena *arena;    /* the buffers of such a slot */
+    int      node;          /* NUMA node its buffers are placed on */
+    nlTiles  tiles;
+    double  *dists;     /* distances and gweights of a search window row */
+    double  *vsums;     /* column sums of a row for one search offset, CompareOffsets */
+    double  *cols;      /* column sums per search offset, GetFrameWOZ */
     nlCache *fc;
+    nlFrame *own;
+    nlFrame *other;
+    int     *mvs;
+    const nlPicture *prev;
+    const nlPicture *maskf;
+    uint8_t *skip;
+    int     *hist;
+    double   hs[3];     /* h2in or hin of the frame being filtered, per plane */
+    int64_t  comparisons;   /* counters of the frame being filtered, for nlReport */
+    int64_t  pruned;
+    int64_t  cache_hits;
+    int64_t  wait_us;
     SDATA   *ds;
     nlThread();
     ~nlThread();
 };
 
+class TNLMeans;
+
+/* Holds the slot of a thread for one GetFrame call. */
 class ActiveThread
 {
 private:
-    int        id;
+    TNLMeans  *filter;
     nlThread  *thread;
 public:
-    inline int &GetId() { return id; };
-    ActiveThread
-    (
-        nlThread * &threads,
-        int        &numThreads,
-        std::mutex &mtx
-    );
+    inline nlThread *GetThread() { return thread; };
+    ActiveThread( TNLMeans *_filter, nlThread *_thread ) : filter( _filter ), thread( _thread ) {}
     ~ActiveThread();
 };
 
@@ -124,25 +314,178 @@ private:
     int       Bxd, Byd, Bxa;
     int       Axd, Ayd, Axa, Azdm1;
     double    a, a2;
-    double    h, hin, h2in;
+    double    h, hin, h2in, hauto;
+    bool      masked;
+    int       me_range, me_block;
+    int       mvw, mvh;
+    int       flat;
+    bool      skipping;
+    int       skip_offset[3], skip_size;
     bool      use_ssd;
+    bool      sequential;
+    bool      hugepages;
+    int       numNodes;
     int       numThreads;
+    size_t    max_memory;
+    std::atomic< size_t > footprint;
+    nlKernels kernels;
+    AlignedArena arena;
+    double   *gw;       /* Gaussian weights of a patch, shared by all threads */
+    std::vector< std::unique_ptr< nlWindow > > windows;     /* one per NUMA node */
+    nlFrame  *recent;
+    nlSource *source;
     nlThread *threads;
+    std::atomic< nlThread * > extra;
+    std::atomic< int >        numSlots;
+    uint64_t  id;
+    static std::atomic< uint64_t > instances;
     std::mutex mtx;
+    std::atomic< int > last_request;
+    std::atomic< int > linear_run;
+    std::condition_variable freed;      /* a slot was released while threads waited */
+    std::atomic< int > waiting;
+    friend class ActiveThread;
     int mapn( int n );
-    template < typename pixel > inline double GetSSD( const pixel * &s1, const pixel * &s2, const double * &gwT, const int &k ) { return (s1[k] - s2[k]) * (s1[k] - s2[k]) * gwT[k]; }
+    void InitThread( nlThread *t );
+    void FillWeights( double *gw ) const;
+    size_t FrameSize();
+    void PlaceBuffers( nlThread *threads );
+    void PlaceThread( nlThread *t, AlignedArena &arena );
+    size_t EstimateFootprint( nlThread *threads );
+    int WindowSize( int node );
+    nlThread *CreateThread( int node );
+    nlThread *TakeThread( int node, bool anywhere );
+    nlThread *AcquireThread();
+    void ReleaseThread( nlThread *t );
+    const nlPicture *FetchFrame( int n, nlProvider *provider );
+    void LoadFrames( nlCache *fc, int n, nlProvider *provider );
+    void ClampToScene( nlCache *fc, int &startz, int &stopz );
+    /* Squared in double like the SIMD kernels, as 16-bit differences overflow an int. */
+    inline double Square( const int d ) { return static_cast<double>(d) * d; }
+    template < typename pixel > inline double GetSSD( const pixel * &s1, const pixel * &s2, const double * &gwT, const int &k ) { return Square( s1[k] - s2[k] ) * gwT[k]; }
     template < typename pixel > inline double GetSAD( const pixel * &s1, const pixel * &s2, const double * &gwT, const int &k ) { return std::abs( s1[k] - s2[k] ) * gwT[k]; }
-    inline double GetSSDWeight( const double &diff, const double &gweights ) { return std::exp( (diff / gweights) * h2in ); }
-    inline double GetSADWeight( const double &diff, const double &gweights ) { return std::exp( (diff / gweights) * hin ); }
-    template < int ssd, typename pixel > void GetFrameByMethod( int n, const int threadId, const int peak, VSFrameRef *dst, VSFrameContext *frame_ctx, VSCore *core, const VSAPI *vsapi );
-    template < int ssd, typename pixel > void GetFrameWZ      ( int n, const int threadId, const int peak, VSFrameRef *dst, VSFrameContext *frame_ctx, VSCore *core, const VSAPI *vsapi );
-    template < int ssd, typename pixel > void GetFrameWZB     ( int n, const int threadId, const int peak, VSFrameRef *dst, VSFrameContext *frame_ctx, VSCore *core, const VSAPI *vsapi );
-    template < int ssd, typename pixel > void GetFrameWOZ     ( int n, const int threadId, const int peak, VSFrameRef *dst, VSFrameContext *frame_ctx, VSCore *core, const VSAPI *vsapi );
-    template < int ssd, typename pixel > void GetFrameWOZB    ( int n, const int threadId, const int peak, VSFrameRef *dst, VSFrameContext *frame_ctx, VSCore *core, const VSAPI *vsapi );
+    inline double GetSSDWeight( const double &diff, const double &gweights, const double &h2in ) { return std::exp( (diff / gweights) * h2in ); }
+    inline double GetSADWeight( const double &diff, const double &gweights, const double &hin  ) { return std::exp( (diff / gweights) * hin ); }
+    /* Weighted distance of the patch of s2 to the patch of s1 over the rows yT .. yB
+     * and columns xL .. xR, through the kernel if there is one. */
+    template < int ssd, typename pixel > inline double PatchDistance( const nlPatchDistance kernel, const pixel *s1, const pixel *s2, const int pitch, const double *gwT, const int xL, const int xR, const int yT, const int yB, double &gweights )
+    {
+        if( kernel )
+            return kernel( s1, s2, pitch, gwT, Sxd, xL, xR, yB - yT + 1, &gweights );
+        double diff = 0.0;
+        for( int j = yT; j <= yB; ++j )
+        {
+            for( int k = xL; k <= xR; ++k )
+            {
+                diff     += ssd ? GetSSD( s1, s2, gwT, k ) : GetSAD( s1, s2, gwT, k );
+                gweights += gwT[k];
+            }
+            ForwardPointer( s1, pitch );
+            ForwardPointer( s2, pitch );
+            gwT += Sxd;
+        }
+        return diff;
+    }
+    /* Distances of the patch of s2 to the 'count' patches of s1 .. s1 + count - 1,
+     * four at a time, each summed in the order of PatchDistance. */
+    template < int ssd, typename pixel > inline void StripDistance( const nlStripDistance kernel, const pixel *s1, const pixel *s2, const int pitch, const double *gwT, const int xL, const int xR, const int yT, const int yB, const int count, double *diffs )
+    {
+        if( kernel )
+            return kernel( s1, s2, pitch, gwT, Sxd, xL, xR, yB - yT + 1, count, diffs );
+        int i = 0;
+        for( ; i + 4 <= count; i += 4 )
+        {
+            const pixel  *s1T = s1 + i;
+            const pixel  *s2T = s2;
+            const double *gwTT = gwT;
+            double d0 = 0.0, d1 = 0.0, d2 = 0.0, d3 = 0.0;
+            for( int j = yT; j <= yB; ++j )
+            {
+                for( int k = xL; k <= xR; ++k )
+                {
+                    const int r = s2T[k];
+                    if( ssd )
+                    {
+                        d0 += Square( s1T[k    ] - r ) * gwTT[k];
+                        d1 += Square( s1T[k + 1] - r ) * gwTT[k];
+                        d2 += Square( s1T[k + 2] - r ) * gwTT[k];
+                        d3 += Square( s1T[k + 3] - r ) * gwTT[k];
+                    }
+                    else
+                    {
+                        d0 += std::abs( s1T[k    ] - r ) * gwTT[k];
+                        d1 += std::abs( s1T[k + 1] - r ) * gwTT[k];
+                        d2 += std::abs( s1T[k + 2] - r ) * gwTT[k];
+                        d3 += std::abs( s1T[k + 3] - r ) * gwTT[k];
+                    }
+                }
+                ForwardPointer( s1T, pitch );
+                ForwardPointer( s2T, pitch );
+                gwTT += Sxd;
+            }
+            diffs[i    ] = d0;
+            diffs[i + 1] = d1;
+            diffs[i + 2] = d2;
+            diffs[i + 3] = d3;
+        }
+        for( ; i < count; ++i )
+        {
+            double gweights = 0.0;
+            diffs[i] = PatchDistance< ssd >( nullptr, s1 + i, s2, pitch, gwT, xL, xR, yT, yB, gweights );
+        }
+    }
+    template < int ssd, typename pixel > void RowDistances( const pixel *s1, const pixel *s2, const int pitch, const double *gwT, const int x, const int startx, const int stopx, const int yT, const int yB, const int widthm1, const uint8_t *skip, double *dists );
+    template < int ssd, typename pixel > void SumColumns( const pixel *pfp, const int pitch, const int c, const int y, const int stopy, const int yT, const int widthm1, const int heightm1, const double *gwy, double *cols );
+    template < typename pixel > void EstimateMotion( const pixel *pfp, const pixel *pcp, const int pitch, const int width, const int height, int *mv );
+    template < typename pixel > void NoiseRows( const pixel *s0, const int pitch, const int width, int *hist );
+    double NoiseSigma( const int *hist, const int64_t count );
+    template < typename pixel > double EstimateNoise( const nlPicture *pf, const int plane, int *hist );
+    template < typename pixel > int64_t BuildSkipMaps( const nlPicture *srcPF, const nlPicture *maskPF, const int peak, uint8_t *skip, double *sigma, int *hist );
+    template < typename pixel > pixel SkippedValue( const pixel *pfp, const int pitch, const int width, const int height, const int x, const int y, const uint8_t type );
+    template < typename pixel > bool SkipBlock( const uint8_t *skip, const pixel *pfp, pixel *dstp, const int pitch, const int width, const int height, const int x0, const int y0, const int xTr, const int yTr );
+    template < int ssd, typename pixel > int64_t CompareOffsets( const pixel *pfp, const pixel *pcp, const int pitch, const int width, const int height, const double *gw, double *vsums, SDATA *dds, SDATA *cds, const uint8_t *skip, const double hs );
+    template < int ssd, typename pixel > int64_t CompareFrames( const pixel *pfp, const pixel *pcp, const int pitch, const int width, const int height, const double *gw, double *dists, double *vsums, SDATA *dds, SDATA *cds, const int *mv, const int shx, const int shy, const uint8_t *skip, const double hs );
+    template < int ssd, typename pixel > void GetFrameByMethod( int n, nlThread *thread, const int peak, const nlPicture *dst, nlProvider *provider );
+    template < int ssd, typename pixel > void GetFrameWZ      ( int n, nlThread *thread, const int peak, const nlPicture *dst, nlProvider *provider );
+    template < int ssd, typename pixel > void GetFrameWZB     ( int n, nlThread *thread, const int peak, const nlPicture *dst, nlProvider *provider );
+    template < int ssd, typename pixel > void GetFrameWOZ     ( int n, nlThread *thread, const int peak, const nlPicture *dst, nlProvider *provider );
+    template < int ssd, typename pixel > void GetFrameWOZB    ( int n, nlThread *thread, const int peak, const nlPicture *dst, nlProvider *provider );
     template < typename T > inline void ForwardPointer(       T * &p, const int offset ) { p = reinterpret_cast<      T *>(reinterpret_cast<      uint8_t *>(p) + offset); }
     template < typename T > inline void ForwardPointer( const T * &p, const int offset ) { p = reinterpret_cast<const T *>(reinterpret_cast<const uint8_t *>(p) + offset); }
     template < typename pixel > inline       pixel *GetPixel(       pixel *p, const int offset ) { return reinterpret_cast<      pixel *>(reinterpret_cast<      uint8_t *>(p) + offset); }
     template < typename pixel > inline const pixel *GetPixel( const pixel *p, const int offset ) { return reinterpret_cast<const pixel *>(reinterpret_cast<const uint8_t *>(p) + offset); }
+    inline void GetMotion( const int *mv, const int x, const int y, const int shx, const int shy, int &dx, int &dy )
+    {
+        if( mv == nullptr ) { dx = dy = 0; return; }
+        const int *v = mv + (((y << shy) / me_block) * mvw + (x << shx) / me_block) * 2;
+        dx = v[0] >> shx;
+        dy = v[1] >> shy;
+    }
+    /* For the block centred on (x, y) and a candidate (v, u) of the same frame: 1 if the
+     * candidate is the centre of a later block whose window holds (x, y), -1 for such
+     * an earlier block, and 0 otherwise. The windows of both contain the same rows and
+     * columns of the other's block, so the pair may be compared once for both. */
+    inline int PairedBlock( const int x, const int y, const int v, const int u, const int widthm1, const int heightm1 )
+    {
+        if( (u - By) % Byd || (v - Bx) % Bxd ) return 0;
+        if( y > heightm1 - std::min( By, heightm1 - u ) || x > widthm1 - std::min( Bx, widthm1 - v ) ) return 0;
+        return (u > y || (u == y && v > x)) ? 1 : -1;
+    }
+    /* Add the block of sbp, rows -By .. yBb and columns -Bx .. xRb, with the weight. */
+    template < typename pixel > inline void AccumulateBlock( const pixel *sbp, const int pitch, const double weight, const int yBb, const int xRb, double *sumsbT, double *weightsbT )
+    {
+        for( int j = -By; j <= yBb; ++j )
+        {
+            for( int k = -Bx; k <= xRb; ++k )
+            {
+                sumsbT   [k] += sbp[k]*weight;
+                weightsbT[k] += weight;
+            }
+            sumsbT    += Bxd;
+            weightsbT += Bxd;
+            ForwardPointer( sbp, pitch );
+        }
+    }
     template < typename pixel > inline const pixel GetPixelValue( const pixel *p, const int offset ) { return *reinterpret_cast<const pixel *>(reinterpret_cast<const uint8_t *>(p) + offset); }
     inline const int GetPixelMaxValue( const int bps )
     {
@@ -151,23 +494,30 @@ private:
     }
 
 public:
-    VSVideoInfo vi;
-    VSNodeRef  *node;
-    void RequestFrame( int n, VSFrameContext *frame_ctx, VSCore *core, const VSAPI *vsapi );
-    VSFrameRef *GetFrame( int n, VSFrameContext *frame_ctx, VSCore *core, const VSAPI *vsapi );
+    nlVideoInfo vi;
+    enum { SKIP_NONE = 0, SKIP_COPY, SKIP_FLAT };
+    /* Announce the frames needed for frame n. */
+    void RequestFrame( int n, nlProvider *provider );
+    /* Take frame n of the clip, fetched ahead after a call to prefetch. */
+    void PutFrame( int n, const nlPicture *pf );
+    /* Filter frame n into dst, which has the format and dimensions of the clip. */
+    void GetFrame( int n, const nlPicture *dst, nlProvider *provider, nlReport *report );
+    /* Most pictures the filter holds at once while no more than 'threads' frames
+     * are filtered in parallel, so a host can keep that many ready. */
+    int MaxPictures() const;
     using bad_param = class bad_param : public CustomException { using CustomException::CustomException; };
     using bad_alloc = class bad_alloc : public CustomException { using CustomException::CustomException; };
+    using bad_frame = class bad_frame : public CustomException { using CustomException::CustomException; };
     /* Constructor */
     TNLMeans
     (
         int _Ax, int _Ay, int _Az,
         int _Sx, int _Sy,
         int _Bx, int _By,
-        double _a, double _h, bool ssd,
-        const VSMap *in,
-        VSMap       *out,
-        VSCore      *core,
-        const VSAPI *vsapi
+        double _a, double _h, double _hauto, bool ssd,
+        int _me_range, int _me_block, bool _recursive, bool _sequential, int _flat,
+        bool _hugepages, bool _numa, int _max_memory, int _simd,
+        const nlVideoInfo &_vi, int _threads, bool _masked
     );
     /* Destructor */
     ~TNLMeans();
@@ -180,3 +530,29 @@ static inline void fill_zero_d( double *x, size_t n )
     else
         std::fill_n( x, n, 0.0 );
 }
+
+/* Zero the accumulator rows up to and including 'last' that were not cleared yet. */
+static inline void clear_rows_d( SDATA *ds, int last, int width )
+{
+    if( ds->cleared > last )
+        return;
+    const size_t offset = static_cast<size_t>(ds->cleared)       * width;
+    const size_t n      = static_cast<size_t>(last + 1 - ds->cleared) * width;
+    fill_zero_d( ds->sums    + offset, n );
+    fill_zero_d( ds->weights + offset, n );
+    fill_zero_d( ds->wmaxs   + offset, n );
+    ds->cleared = last + 1;
+}
+
+/* Add the accumulated rows of src into dst. */
+static inline void add_ds( SDATA *dst, const SDATA *src )
+{
+    clear_rows_d( dst, dst->height - 1, dst->width );
+    const size_t n = static_cast<size_t>(src->cleared) * src->width;
+    for( size_t i = 0; i < n; ++i )
+    {
+        dst->sums   [i] += src->sums   [i];
+        dst->weights[i] += src->weights[i];
+        if( src->wmaxs[i] > dst->wmaxs[i] ) dst->wmaxs[i] = src->wmaxs[i];
+    }
+}
@@ -0,0 +1,62 @@
+/**
+ * @file mingw.condition_variable.h
+ * @brief std::condition_variable implementation for MinGW
+ *
+ * Companion of mingw.thread.h and mingw.mutex.h. Only what the filter uses:
+ * wait() on a std::unique_lock< std::mutex >, with or without a predicate,
+ * and notify_one() / notify_all(). Needs Windows Vista or later.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * @copyright GNU LGPL version 2.1 License.
+ */
+#ifndef WIN32STDCONDVAR_H
+#define WIN32STDCONDVAR_H
+
+#include <windows.h>
+
+namespace std
+{
+/* The caller's mutex is released only once mLock is held, and notifiers take
+ * mLock before waking, so a notification cannot fall between the release of
+ * the caller's mutex and the start of the sleep. */
+class condition_variable
+{
+protected:
+    CONDITION_VARIABLE mHandle;
+    SRWLOCK mLock;
+public:
+    condition_variable() { InitializeConditionVariable(&mHandle); InitializeSRWLock(&mLock); }
+    condition_variable(const condition_variable&) = delete;
+    condition_variable& operator=(const condition_variable&) = delete;
+    void wait(unique_lock<mutex>& lock)
+    {
+        AcquireSRWLockExclusive(&mLock);
+        lock.unlock();
+        SleepConditionVariableSRW(&mHandle, &mLock, INFINITE, 0);
+        ReleaseSRWLockExclusive(&mLock);
+        lock.lock();
+    }
+    template <class Predicate>
+    void wait(unique_lock<mutex>& lock, Predicate pred)
+    {
+        while (!pred())
+            wait(lock);
+    }
+    void notify_one()
+    {
+        AcquireSRWLockExclusive(&mLock);
+        ReleaseSRWLockExclusive(&mLock);
+        WakeConditionVariable(&mHandle);
+    }
+    void notify_all()
+    {
+        AcquireSRWLockExclusive(&mLock);
+        ReleaseSRWLockExclusive(&mLock);
+        WakeAllConditionVariable(&mHandle);
+    }
+};
+}
+#endif // WIN32STDCONDVAR_H